@@ -0,0 +1,149 @@
+// Extraction rate of a layer made of many small files, for each extraction backend.
+// Usage: extractBench [<files>] [<bytes-per-file>] [<runs>]
+//
+// The layer is generated once (100 files per directory, packed with tar) and then extracted <runs>
+// times into a fresh directory by extract_layer() with the tar, uring and threads backends in turn.
+// Everything happens under /tmp, set TMPDIR to benchmark another filesystem.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "layerExtract.h"
+#include "systemUtils.h"
+
+#define FILES_PER_DIR 100
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int generate_layer(const char *work_dir, long files, size_t file_size) {
+    char path[PATH_MAX];
+    char *data = malloc(file_size + 1);
+    if (!data) {
+        return -1;
+    }
+    for (size_t i = 0; i < file_size; i++) {
+        data[i] = 'a' + i % 26;
+    }
+
+    for (long i = 0; i < files; i++) {
+        if (i % FILES_PER_DIR == 0) {
+            snprintf(path, sizeof(path), "%s/src/d%05ld", work_dir, i / FILES_PER_DIR);
+            if (mkdir_p(path, 0755) == -1) {
+                perror("Error creating source tree");
+                free(data);
+                return -1;
+            }
+        }
+        snprintf(path, sizeof(path), "%s/src/d%05ld/f%07ld", work_dir, i / FILES_PER_DIR, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1 || write(fd, data, file_size) != (ssize_t)file_size) {
+            perror("Error writing source tree");
+            if (fd != -1) close(fd);
+            free(data);
+            return -1;
+        }
+        close(fd);
+    }
+    free(data);
+
+    char command[PATH_MAX * 2 + 64];
+    snprintf(command, sizeof(command), "tar -C '%s/src' -cf '%s/layer.tar' .", work_dir, work_dir);
+    return system(command) == 0 ? 0 : -1;
+}
+
+// Extract the layer runs times, returns the best time in seconds or -1
+static double time_backend(const char *work_dir, int work_fd, ExtractBackend backend, int runs, double *mean) {
+    char tarball[PATH_MAX];
+    char dest[PATH_MAX];
+    snprintf(tarball, sizeof(tarball), "%s/layer.tar", work_dir);
+    snprintf(dest, sizeof(dest), "%s/dest", work_dir);
+
+    set_extract_backend(backend);
+    double best = -1, total = 0;
+    for (int run = 0; run < runs; run++) {
+        if (mkdir(dest, 0755) == -1) {
+            perror("Error creating extraction directory");
+            return -1;
+        }
+        double start = now();
+        int result = extract_layer(tarball, dest);
+        double elapsed = now() - start;
+        remove_tree_at(work_fd, "dest");
+        if (result == -1) {
+            return -1;
+        }
+        total += elapsed;
+        if (best < 0 || elapsed < best) best = elapsed;
+    }
+    *mean = total / runs;
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    long files = argc > 1 ? atol(argv[1]) : 20000;
+    long file_size = argc > 2 ? atol(argv[2]) : 512;
+    int runs = argc > 3 ? atoi(argv[3]) : 3;
+    if (files <= 0 || file_size < 0 || runs <= 0) {
+        fprintf(stderr, "Usage: %s [<files>] [<bytes-per-file>] [<runs>]\n", argv[0]);
+        return 1;
+    }
+
+    const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char work_dir[1024];
+    if (snprintf(work_dir, sizeof(work_dir), "%s/ldenv_extract_bench_XXXXXX", tmp) >= (int)sizeof(work_dir)) {
+        fprintf(stderr, "TMPDIR is too long\n");
+        return 1;
+    }
+    if (!mkdtemp(work_dir)) {
+        perror("Error creating work directory");
+        return 1;
+    }
+    int work_fd = open(work_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (work_fd == -1) {
+        perror("Error opening work directory");
+        return 1;
+    }
+
+    printf("[*] Generating %ld files of %ld bytes in %s\n", files, file_size, work_dir);
+    if (generate_layer(work_dir, files, file_size) == -1) {
+        fprintf(stderr, "Error generating the layer\n");
+        remove_tree_at(AT_FDCWD, work_dir);
+        return 1;
+    }
+
+    static const struct { const char *name; ExtractBackend backend; } backends[] = {
+        {"tar", EXTRACT_BACKEND_TAR},
+        {"uring", EXTRACT_BACKEND_URING},
+        {"threads", EXTRACT_BACKEND_THREADS},
+    };
+    double best[3], mean[3];
+    for (int i = 0; i < 3; i++) {
+        best[i] = time_backend(work_dir, work_fd, backends[i].backend, runs, &mean[i]);
+    }
+    fflush(stdout);
+
+    printf("\n%ld files, %d runs each\n", files, runs);
+    printf("%-8s %14s %14s\n", "backend", "best files/s", "mean files/s");
+    int status = 0;
+    for (int i = 0; i < 3; i++) {
+        if (best[i] < 0) {
+            printf("%-8s %14s %14s\n", backends[i].name, "failed", "failed");
+            status = 1;
+            continue;
+        }
+        printf("%-8s %14.0f %14.0f\n", backends[i].name, files / best[i], files / mean[i]);
+    }
+
+    close(work_fd);
+    remove_tree_at(AT_FDCWD, work_dir);
+    return status;
+}
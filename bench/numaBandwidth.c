@@ -0,0 +1,102 @@
+// Memory bandwidth from the node that holds the memory vs from every other node.
+// Usage: numaBandwidth [<memory-node>] [<MiB>] [<passes>]
+//
+// The buffer is allocated and touched with the placement of <memory-node> (MPOL_BIND plus the
+// node's CPUs, the same apply_placement() a container gets), then read and written from the CPUs of
+// each node in turn. Pages stay where they were first touched, so every other node is a cross-node run.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "placement.h"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool node_exists(int node) {
+    char path[256];
+    struct stat st;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+    return stat(path, &st) == 0;
+}
+
+static int place_on(int node) {
+    Placement placement;
+    init_placement(&placement);
+    placement.node = node;
+    return apply_placement(&placement);
+}
+
+// Sum the buffer one 64-bit word at a time, returns GB/s
+static double read_bandwidth(const uint64_t *buf, size_t words, int passes, uint64_t *sink) {
+    uint64_t sum = 0;
+    double start = now();
+    for (int pass = 0; pass < passes; pass++) {
+        for (size_t i = 0; i < words; i++) {
+            sum += buf[i];
+        }
+    }
+    double elapsed = now() - start;
+    *sink += sum;
+    return (double)words * sizeof(uint64_t) * passes / elapsed / 1e9;
+}
+
+static double write_bandwidth(uint64_t *buf, size_t words, int passes) {
+    double start = now();
+    for (int pass = 0; pass < passes; pass++) {
+        memset(buf, pass, words * sizeof(uint64_t));
+    }
+    double elapsed = now() - start;
+    return (double)words * sizeof(uint64_t) * passes / elapsed / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int memory_node = argc > 1 ? atoi(argv[1]) : 0;
+    size_t mib = argc > 2 ? strtoul(argv[2], NULL, 10) : 512;
+    int passes = argc > 3 ? atoi(argv[3]) : 5;
+    if (!node_exists(memory_node) || mib == 0 || passes <= 0) {
+        fprintf(stderr, "Usage: %s [<memory-node>] [<MiB>] [<passes>]\n", argv[0]);
+        return 1;
+    }
+
+    if (place_on(memory_node) == -1) {
+        return 1;
+    }
+    size_t words = mib * 1024 * 1024 / sizeof(uint64_t);
+    uint64_t *buf = malloc(words * sizeof(uint64_t));
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < words; i++) {
+        buf[i] = i; // --> first touch puts every page on memory_node
+    }
+
+    printf("%zu MiB on node %d, %d passes\n", mib, memory_node, passes);
+    printf("%-8s %-8s %12s %12s\n", "cpus", "access", "read GB/s", "write GB/s");
+
+    uint64_t sink = 0;
+    int measured = 0;
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        if (!node_exists(node) || place_on(node) == -1) {
+            continue; // --> memory-only node
+        }
+        double read = read_bandwidth(buf, words, passes, &sink);
+        double write = write_bandwidth(buf, words, passes);
+        printf("node%-4d %-8s %12.2f %12.2f\n", node, node == memory_node ? "local" : "remote", read, write);
+        measured++;
+    }
+    if (measured < 2) {
+        printf("Only one node with CPUs, no cross-node numbers on this machine.\n");
+    }
+
+    free(buf);
+    return sink == 42 ? 2 : 0; // --> keeps the reads from being optimised away
+}
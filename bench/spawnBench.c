@@ -0,0 +1,185 @@
+// Spawn latency of the container start paths on an already prepared rootfs, from the start of the
+// spawn to the child's successful execv().
+// Usage: spawnBench <rootfs> <command> [<iterations>] [<heap-MiB>]   (as root, e.g. a rootfs from the
+//        image store and a command that exits right away such as /bin/true)
+//
+// The launcher has fetched and checked out the image by the time it spawns, so it is no longer a
+// small process. The benchmark first fills a heap of <heap-MiB> (256 by default) to stand in for
+// that: fork() copies the page tables of all of it, the CLONE_VM spawn of clone3 copies nothing.
+//
+//   fork          what --spawn=fork does: unshare(CLONE_NEWPID) in the launcher, fork(), chroot, execv
+//   fork+unshare  the same, plus unshare(CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC) in the child, so
+//                 it ends up in the same namespaces as the clone3 path
+//   clone3        spawn_container(): clone3() with the namespaces, CLONE_VM and CLONE_VFORK, chroot, execv
+//
+// The end of the spawn is seen by the launcher as EOF on a close-on-exec pipe held by the child.
+// Nothing is fetched or checked out, the rootfs is used as is (the command only runs, it writes
+// nothing). The hostname is never changed.
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "spawn.h"
+
+#define DEFAULT_HEAP_MIB 256
+
+typedef enum BenchPath { PATH_FORK, PATH_FORK_UNSHARE, PATH_CLONE3, PATHS } BenchPath;
+
+static const char *path_names[PATHS] = {"fork", "fork+unshare", "clone3"};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// The forked child of the fork paths, mirrors the child in main.c minus the image fetch
+static void exec_forked(BenchPath path, const char *rootfs, char *const argv[], int null_fd) {
+    if (path == PATH_FORK_UNSHARE && unshare(CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC) == -1) {
+        _exit(-1);
+    }
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    if (chdir(rootfs) || chroot(rootfs)) {
+        _exit(-1);
+    }
+    execv(argv[0], argv);
+    _exit(-1);
+}
+
+// One spawn, returns the time to exec in seconds or -1. pidns_fd is the launcher's own PID namespace:
+// the fork paths go back to it after each spawn, so every container gets a fresh PID namespace.
+static double spawn_once(BenchPath path, const char *rootfs, char *const argv[], int null_fd, int pidns_fd) {
+    int exec_pipe[2];
+    if (pipe2(exec_pipe, O_CLOEXEC) == -1) {
+        perror("Error creating pipe");
+        return -1;
+    }
+
+    fflush(stdout);
+    double start = now();
+    pid_t pid;
+    int pidfd = -1;
+    if (path == PATH_CLONE3) {
+        pid = spawn_container(rootfs, argv, null_fd, null_fd, &pidfd);
+    } else {
+        if (unshare(CLONE_NEWPID) == -1) {
+            perror("Error unsharing the PID namespace");
+            close(exec_pipe[0]);
+            close(exec_pipe[1]);
+            return -1;
+        }
+        pid = fork();
+        if (pid == 0) {
+            exec_forked(path, rootfs, argv, null_fd);
+        }
+    }
+    close(exec_pipe[1]);
+
+    char byte;
+    while (read(exec_pipe[0], &byte, 1) > 0) {
+        // --> nothing is ever written, the read returns 0 once the child has exec'd (or died)
+    }
+    double elapsed = now() - start;
+    close(exec_pipe[0]);
+
+    if (path != PATH_CLONE3 && setns(pidns_fd, CLONE_NEWPID) == -1) {
+        perror("Error returning to the launcher's PID namespace");
+        pid = -1;
+    }
+    if (pid == -1) {
+        perror("Error spawning");
+        return -1;
+    }
+
+    int status;
+    if (wait_container(pid, pidfd, &status) == -1) {
+        perror("Error waiting for the container");
+        return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error, %s exited with status %d in %s (%s path)\n", argv[0], status, rootfs, path_names[path]);
+        return -1;
+    }
+    return elapsed;
+}
+
+static void print_distribution(const char *name, double *samples, int count) {
+    qsort(samples, count, sizeof(double), compare_doubles);
+    double total = 0;
+    for (int i = 0; i < count; i++) {
+        total += samples[i];
+    }
+    printf("%-13s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, samples[0] * 1e6, samples[count / 2] * 1e6,
+           samples[count * 9 / 10] * 1e6, samples[count * 99 / 100] * 1e6, samples[count - 1] * 1e6,
+           total / count * 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 3 ? atoi(argv[3]) : 1000;
+    long heap_mib = argc > 4 ? atol(argv[4]) : DEFAULT_HEAP_MIB;
+    if (argc < 3 || argc > 5 || iterations <= 0 || heap_mib < 0) {
+        fprintf(stderr, "Usage: %s <rootfs> <command> [<iterations>] [<heap-MiB>]\n", argv[0]);
+        return 1;
+    }
+    const char *rootfs = argv[1];
+    char *command_argv[] = {argv[2], NULL};
+
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int pidns_fd = open("/proc/self/ns/pid", O_RDONLY | O_CLOEXEC);
+    if (null_fd == -1 || pidns_fd == -1) {
+        perror("Error opening /dev/null or the PID namespace");
+        return 1;
+    }
+    double *samples[PATHS];
+    for (int path = 0; path < PATHS; path++) {
+        samples[path] = malloc(iterations * sizeof(double));
+        if (!samples[path]) {
+            perror("Error allocating samples");
+            return 1;
+        }
+    }
+
+    // Written, so every page is resident and mapped when the spawns start
+    size_t heap_size = (size_t)heap_mib * 1024 * 1024;
+    char *heap = malloc(heap_size ? heap_size : 1);
+    if (!heap) {
+        perror("Error allocating the launcher heap");
+        return 1;
+    }
+    memset(heap, 1, heap_size);
+
+    // The paths take turns so that drift over the run (page cache, frequency) hits all of them
+    printf("[*] Spawning %s in %s, %d times per path, from a launcher holding %ld MiB\n", argv[2], rootfs,
+           iterations, heap_mib);
+    for (int i = 0; i < iterations; i++) {
+        for (int path = 0; path < PATHS; path++) {
+            samples[path][i] = spawn_once((BenchPath)path, rootfs, command_argv, null_fd, pidns_fd);
+            if (samples[path][i] < 0) {
+                fprintf(stderr, "[-] %s spawn failed, stopping\n", path_names[path]);
+                return 1;
+            }
+        }
+    }
+
+    printf("\nspawn to exec in microseconds, %d spawns per path, %ld MiB launcher heap\n", iterations, heap_mib);
+    printf("%-13s %9s %9s %9s %9s %9s %9s\n", "path", "min", "p50", "p90", "p99", "max", "mean");
+    for (int path = 0; path < PATHS; path++) {
+        print_distribution(path_names[path], samples[path], iterations);
+        free(samples[path]);
+    }
+    free(heap);
+    close(null_fd);
+    close(pidns_fd);
+    return 0;
+}
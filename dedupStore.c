@@ -0,0 +1,279 @@
+#define _GNU_SOURCE // --> for nftw() flags
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include "dedupStore.h"
+#include "imageStore.h"
+#include "sha256.h"
+#include "systemUtils.h"
+
+// Content-addressed file store shared by every rootfs in the image store. Entries are keyed by
+// content hash only. A rootfs file linked to an entry shows the entry's mode, owner and mtime, so
+// files whose own metadata differs are listed in the rootfs' metadata record and get it back at
+// checkout. The link count of an entry is its reference count: an entry with a single link is no
+// longer used by any rootfs.
+// Within one rootfs an entry is only taken by one of the image's own hard link groups (one original
+// inode), so the links a checkout keeps are exactly the image's hard links. Files with extended
+// attributes (capabilities, ACLs) stay private, those live on the inode too.
+
+#define CLAIMS_INITIAL_CAPACITY 1024
+
+// Which original inode of the rootfs took each entry, open addressing on the hash
+typedef struct Claim {
+    char hex[SHA256_HEX_SIZE];   // empty for a free slot
+    dev_t dev;
+    ino_t ino;
+} Claim;
+
+typedef struct ClaimTable {
+    Claim *slots;
+    size_t capacity;
+    size_t used;
+} ClaimTable;
+
+static DedupStats *current_stats;
+static ClaimTable claims;
+static FILE *current_metadata;
+static size_t root_length;
+
+static void entry_path(const char *hex, char *path, size_t size) {
+    snprintf(path, size, "%s/files/%.2s/%s", image_store_dir(), hex, hex);
+}
+
+// The hash is already uniform, its first 64 bits pick the slot
+static Claim *find_claim(ClaimTable *table, const char *hex) {
+    uint64_t hash = 0;
+    sscanf(hex, "%16" SCNx64, &hash);
+    size_t slot = hash % table->capacity;
+    while (table->slots[slot].hex[0] && strcmp(table->slots[slot].hex, hex) != 0) {
+        slot = (slot + 1) % table->capacity;
+    }
+    return &table->slots[slot];
+}
+
+// Returns the claim for hex, taking it for (dev, ino) when nobody has yet. NULL when out of memory.
+static Claim *claim_entry(ClaimTable *table, const char *hex, dev_t dev, ino_t ino) {
+    if ((table->used + 1) * 2 > table->capacity) {
+        ClaimTable grown = { calloc(table->capacity * 2, sizeof(Claim)), table->capacity * 2, 0 };
+        if (!grown.slots) {
+            return NULL;
+        }
+        for (size_t i = 0; i < table->capacity; i++) {
+            if (table->slots[i].hex[0]) {
+                *find_claim(&grown, table->slots[i].hex) = table->slots[i];
+                grown.used++;
+            }
+        }
+        free(table->slots);
+        *table = grown;
+    }
+    Claim *claim = find_claim(table, hex);
+    if (!claim->hex[0]) {
+        strcpy(claim->hex, hex);
+        claim->dev = dev;
+        claim->ino = ino;
+        table->used++;
+    }
+    return claim;
+}
+
+// Replace path with a hard link to the store entry, keeping path intact if anything fails
+static int link_from_store(const char *entry, const char *path) {
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.dedup", path);
+
+    if (link(entry, tmp_path) == -1) {
+        return -1;
+    }
+    if (rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Note the file's own metadata when the entry it now links to carries different metadata
+static int record_metadata(const char *path, const struct stat *st, const struct stat *entry_st) {
+    if ((st->st_mode & 07777) == (entry_st->st_mode & 07777) && st->st_uid == entry_st->st_uid &&
+        st->st_gid == entry_st->st_gid && st->st_mtim.tv_sec == entry_st->st_mtim.tv_sec &&
+        st->st_mtim.tv_nsec == entry_st->st_mtim.tv_nsec) {
+        return 0;
+    }
+    if (fprintf(current_metadata, "%o %d %d %lld.%09ld %s\n", (unsigned)(st->st_mode & 07777), (int)st->st_uid,
+                (int)st->st_gid, (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec, path + root_length) < 0) {
+        perror("Error writing dedup metadata");
+        return -1;
+    }
+    return 0;
+}
+
+static int dedup_file(const char *path, const struct stat *st, int type, struct FTW *ftwbuf) {
+    (void)ftwbuf;
+    if (type != FTW_F || !S_ISREG(st->st_mode) || st->st_size == 0) {
+        return 0;
+    }
+    current_stats->files++;
+    if (strchr(path, '\n') || llistxattr(path, NULL, 0) > 0) {
+        return 0; // can't be listed in the metadata record, or carries inode metadata of its own
+    }
+
+    char hex[SHA256_HEX_SIZE];
+    if (sha256_file_hex(path, hex) == -1) {
+        fprintf(stderr, "Could not hash %s\n", path);
+        return 0;
+    }
+    Claim *claim = claim_entry(&claims, hex, st->st_dev, st->st_ino);
+    if (!claim) {
+        perror("Error deduplicating rootfs");
+        return -1;
+    }
+    if (claim->dev != st->st_dev || claim->ino != st->st_ino) {
+        return 0; // an identical file that isn't a hard link of it in the image took the entry
+    }
+
+    char entry[PATH_MAX];
+    entry_path(hex, entry, sizeof(entry));
+
+    // Two attempts: the entry may be collected between the lstat() and the link()
+    for (int attempt = 0; attempt < 2; attempt++) {
+        struct stat entry_st;
+        if (lstat(entry, &entry_st) == 0) {
+            if (entry_st.st_ino == st->st_ino && entry_st.st_dev == st->st_dev) {
+                return 0; // already shared
+            }
+            if (record_metadata(path, st, &entry_st) == -1) {
+                return -1;
+            }
+            if (link_from_store(entry, path) == 0) {
+                current_stats->linked++;
+                current_stats->bytes_saved += st->st_size;
+                return 0;
+            }
+            if (errno != ENOENT) {
+                return 0; // e.g. EMLINK, keep the private copy (its metadata line is harmless)
+            }
+            continue;
+        }
+
+        char entry_dir[PATH_MAX];
+        snprintf(entry_dir, sizeof(entry_dir), "%s/files/%.2s", image_store_dir(), hex);
+        if (mkdir_p(entry_dir, 0755) == -1) {
+            perror("Error creating file store");
+            return -1;
+        }
+        if (link(path, entry) == 0) {
+            current_stats->added++;
+            return 0;
+        }
+        if (errno != EEXIST) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Move every regular file of root_dir into the file store, sharing identical ones. The metadata
+// record for dedup_restore_metadata() is written to metadata_path.
+int dedup_tree(const char *root_dir, const char *metadata_path, DedupStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    current_metadata = fopen(metadata_path, "w");
+    if (!current_metadata) {
+        perror("Error writing dedup metadata");
+        return -1;
+    }
+    claims.capacity = CLAIMS_INITIAL_CAPACITY;
+    claims.used = 0;
+    claims.slots = calloc(claims.capacity, sizeof(Claim));
+    current_stats = stats;
+    root_length = strlen(root_dir) + 1;
+
+    int result = claims.slots ? nftw(root_dir, dedup_file, 64, FTW_PHYS | FTW_MOUNT) : -1;
+    if (result == -1) {
+        perror("Error walking rootfs");
+    }
+    if (fclose(current_metadata) != 0 && result == 0) {
+        perror("Error writing dedup metadata");
+        result = -1;
+    }
+    free(claims.slots);
+    claims.slots = NULL;
+    current_stats = NULL;
+    current_metadata = NULL;
+    return result;
+}
+
+// Give the files of a checked out rootfs in root_dir the metadata listed in the record
+int dedup_restore_metadata(const char *metadata_path, const char *root_dir) {
+    FILE *fp = fopen(metadata_path, "r");
+    if (!fp) {
+        perror("Error reading dedup metadata");
+        return -1;
+    }
+    int root_fd = open(root_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+        perror("Error opening rootfs");
+        fclose(fp);
+        return -1;
+    }
+
+    int result = 0;
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned mode;
+        int uid, gid, offset = 0;
+        long long seconds;
+        long nanoseconds;
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%o %d %d %lld.%ld %n", &mode, &uid, &gid, &seconds, &nanoseconds, &offset) != 5 || !offset) {
+            fprintf(stderr, "Malformed dedup metadata line: %s\n", line);
+            result = -1;
+            continue;
+        }
+        // chown() first, it clears the setuid and setgid bits
+        const char *path = line + offset;
+        struct timespec times[2] = { { 0, UTIME_OMIT }, { (time_t)seconds, nanoseconds } };
+        if (fchownat(root_fd, path, uid, gid, AT_SYMLINK_NOFOLLOW) == -1 || fchmodat(root_fd, path, mode, 0) == -1 ||
+            utimensat(root_fd, path, times, AT_SYMLINK_NOFOLLOW) == -1) {
+            fprintf(stderr, "Error restoring metadata of %s: %s\n", path, strerror(errno));
+            result = -1;
+        }
+    }
+    close(root_fd);
+    fclose(fp);
+    return result;
+}
+
+static long removed_entries;
+
+static int collect_entry(const char *path, const struct stat *st, int type, struct FTW *ftwbuf) {
+    (void)ftwbuf;
+    if (type == FTW_F && st->st_nlink == 1 && unlink(path) == 0) {
+        removed_entries++;
+    }
+    return 0;
+}
+
+// Remove store entries that no rootfs links to any more
+int dedup_gc(long *removed) {
+    char files_dir[PATH_MAX];
+    snprintf(files_dir, sizeof(files_dir), "%s/files", image_store_dir());
+
+    removed_entries = 0;
+    if (access(files_dir, F_OK) == 0 && nftw(files_dir, collect_entry, 64, FTW_PHYS) == -1) {
+        perror("Error walking file store");
+        return -1;
+    }
+    if (removed) {
+        *removed = removed_entries;
+    }
+    return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef DEDUPSTORE_H
+#define DEDUPSTORE_H
+
+#include <sys/types.h>
+
+// Summary of a deduplication pass over a rootfs
+typedef struct DedupStats {
+    long files;          // regular files visited
+    long linked;         // files replaced by a link to an existing store entry
+    long added;          // files that became new store entries
+    off_t bytes_saved;   // size of the copies that were dropped
+} DedupStats;
+
+int dedup_tree(const char *root_dir, const char *metadata_path, DedupStats *stats);
+int dedup_restore_metadata(const char *metadata_path, const char *root_dir);
+int dedup_gc(long *removed);
+#endif
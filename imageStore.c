@@ -0,0 +1,516 @@
+#define _GNU_SOURCE // --> for mkdtemp(), setsid() and renameat2()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "imageStore.h"
+#include "layerExtract.h"
+#include "metrics.h"
+#include "dedupStore.h"
+#include "networking.h"
+#include "parseManifest.h"
+#include "sha256.h"
+#include "systemUtils.h"
+
+#define SHA256_DIGEST_PREFIX "sha256:"
+#define PREFETCH_LOG "prefetch.log"
+#define PULL_LOCK ".pull.lock"
+#define DEDUP_METADATA "dedup_metadata"   // metadata record of a deduplicated rootfs, see dedupStore.c
+
+static bool dedup_enabled = false;
+
+// Store unpacked files once in the content-addressed file store and hard link them into each rootfs
+void image_store_set_dedup(bool enabled) {
+    dedup_enabled = enabled;
+}
+
+const char *image_store_dir() {
+    const char *dir = getenv("LDENV_STORE");
+    return (dir && *dir) ? dir : IMAGE_STORE_DIR;
+}
+
+// Image names end up in store paths, so only accept plain repository names
+static bool valid_image_name(const char *image_name) {
+    if (!*image_name || image_name[0] == '/' || strstr(image_name, "..")) {
+        return false;
+    }
+    for (const char *p = image_name; *p; p++) {
+        if (!islower((unsigned char)*p) && !isdigit((unsigned char)*p) && !strchr("._-/", *p)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void image_path(const char *image_name, const char *entry, char *path, size_t size) {
+    snprintf(path, size, "%s/images/%s/%s", image_store_dir(), image_name, entry);
+}
+
+// Map "sha256:<hex>" to the blob path in the store, returns -1 for unsupported digests
+static int blob_path(const char *digest, char *path, size_t size) {
+    size_t prefix_len = strlen(SHA256_DIGEST_PREFIX);
+    if (strncmp(digest, SHA256_DIGEST_PREFIX, prefix_len) != 0 || strlen(digest + prefix_len) != SHA256_HEX_SIZE - 1) {
+        fprintf(stderr, "Unsupported layer digest: %s\n", digest);
+        return -1;
+    }
+    for (const char *p = digest + prefix_len; *p; p++) {
+        if (!isxdigit((unsigned char)*p) || isupper((unsigned char)*p)) {
+            fprintf(stderr, "Unsupported layer digest: %s\n", digest);
+            return -1;
+        }
+    }
+    snprintf(path, size, "%s/blobs/sha256/%s", image_store_dir(), digest + prefix_len);
+    return 0;
+}
+
+static char *read_whole_file(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    rewind(fp);
+
+    char *data = malloc(size + 1);
+    if (data && fread(data, 1, size, fp) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    if (data) {
+        data[size] = '\0';
+    }
+    fclose(fp);
+    return data;
+}
+
+static int write_file_atomically(const char *path, const char *data) {
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "w");
+    if (!fp) {
+        perror("Error writing store file");
+        return -1;
+    }
+    fputs(data, fp);
+    if (fclose(fp) != 0 || rename(tmp_path, path) == -1) {
+        perror("Error writing store file");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+bool image_store_has(const char *image_name) {
+    char path[1024];
+    struct stat st;
+
+    if (!valid_image_name(image_name)) {
+        return false;
+    }
+    image_path(image_name, "manifest.json", path, sizeof(path));
+    if (stat(path, &st) == -1) {
+        return false;
+    }
+    image_path(image_name, "rootfs", path, sizeof(path));
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Download a layer into the current (staging) directory, check it against its digest and move it into the blob store
+static int store_layer_blob(const char *image_name, const char *digest, const char *destination) {
+    if (access(destination, F_OK) == 0) {
+        printf("[+] Layer %s already present.\n", digest);
+        return 0;
+    }
+
+    // fetch_layer() checks the digest, failing over to another mirror on a mismatch
+    if (fetch_layer(image_name, digest) == -1) {
+        return -1;
+    }
+
+    const char *downloaded = "downloaded_file_0.tar";
+    if (rename(downloaded, destination) == -1) {
+        perror("Error moving layer into store");
+        unlink(downloaded);
+        return -1;
+    }
+    printf("[+] Layer %s verified.\n", digest);
+    return 0;
+}
+
+static void remove_staging(const char *path) {
+    if (remove_tree_at(AT_FDCWD, path) == -1) {
+        fprintf(stderr, "Could not remove %s: %s\n", path, strerror(errno));
+    }
+}
+
+// Remove everything left in <store>/tmp by pulls that died halfway. Only called while holding the
+// store's pull lock exclusively, so no other pull is staging anything there.
+static void sweep_store_tmp() {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/tmp", image_store_dir());
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = dir_fd == -1 ? NULL : fdopendir(dir_fd);
+    if (!dir) {
+        if (dir_fd != -1) close(dir_fd);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        printf("[*] Removing leftover %s/%s\n", path, entry->d_name);
+        if (remove_tree_at(dir_fd, entry->d_name) == -1) {
+            fprintf(stderr, "Could not remove %s/%s: %s\n", path, entry->d_name, strerror(errno));
+        }
+    }
+    closedir(dir);
+}
+
+// Every pull holds the store's pull lock shared. The first pull to find it free sweeps <store>/tmp
+// before taking its shared lock. Returns the lock fd or -1.
+static int lock_store_for_pull() {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" PULL_LOCK, image_store_dir());
+    int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("Error locking image store");
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        sweep_store_tmp();
+    }
+    if (flock(fd, LOCK_SH) == -1) {
+        perror("Error locking image store");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Put new_path in place of path in a single step, either may be missing. Afterwards new_path holds
+// what path held before, so calling it again undoes it.
+static int exchange_paths(const char *new_path, const char *path) {
+    bool have_new = access(new_path, F_OK) == 0;
+    bool have_old = access(path, F_OK) == 0;
+    if (have_new && have_old) {
+        return renameat2(AT_FDCWD, new_path, AT_FDCWD, path, RENAME_EXCHANGE);
+    }
+    if (have_new) {
+        return rename(new_path, path);
+    }
+    return have_old ? rename(path, new_path) : 0;
+}
+
+// Extract the verified blobs into a fresh rootfs and swap it in place of the previous one
+static int unpack_image(const char *image_name, const char *manifest, Manifest_parsed_info *manifest_info) {
+    char manifest_path[1024];
+    char rootfs_path[1024];
+    char lock_path[1024];
+    char metadata_path[1024];
+    char new_metadata_path[1024];
+    image_path(image_name, "manifest.json", manifest_path, sizeof(manifest_path));
+    image_path(image_name, "rootfs", rootfs_path, sizeof(rootfs_path));
+    image_path(image_name, ".lock", lock_path, sizeof(lock_path));
+    image_path(image_name, DEDUP_METADATA, metadata_path, sizeof(metadata_path));
+    image_path(image_name, DEDUP_METADATA ".new", new_metadata_path, sizeof(new_metadata_path));
+
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX) == -1) {
+        perror("Error locking image");
+        if (lock_fd != -1) close(lock_fd);
+        return -1;
+    }
+
+    char *current = read_whole_file(manifest_path);
+    bool up_to_date = current && strcmp(current, manifest) == 0 && access(rootfs_path, F_OK) == 0;
+    free(current);
+    if (up_to_date) {
+        printf("[+] %s is up to date.\n", image_name);
+        close(lock_fd);
+        return 0;
+    }
+
+    char staging[1024];
+    snprintf(staging, sizeof(staging), "%s/tmp/rootfs_XXXXXX", image_store_dir());
+    if (!mkdtemp(staging)) {
+        perror("Error creating staging directory");
+        close(lock_fd);
+        return -1;
+    }
+
+    int count = 0;
+    for (Layer *layer = manifest_info->layersList; layer != NULL; layer = layer->next) {
+        count++;
+    }
+    char (*blobs)[1024] = calloc(count, sizeof(*blobs));
+    char **tarballs = calloc(count, sizeof(char *));
+    int result = (blobs && tarballs) ? 0 : -1;
+    int i = 0;
+    for (Layer *layer = manifest_info->layersList; layer != NULL && result == 0; layer = layer->next, i++) {
+        result = blob_path(layer->digest, blobs[i], sizeof(blobs[i]));
+        tarballs[i] = blobs[i];
+    }
+    if (result == 0) {
+        result = extract_layers(tarballs, count, staging);
+    }
+    free(blobs);
+    free(tarballs);
+    if (result == -1) {
+        fprintf(stderr, "[-] Error unpacking %s.\n", image_name);
+        remove_staging(staging);
+        close(lock_fd);
+        return -1;
+    }
+    printf("[+] %d layers unpacked.\n", count);
+    chmod(staging, 0755);
+
+    // The new rootfs' metadata record is installed together with it, no record means no dedup
+    unlink(new_metadata_path);
+    if (dedup_enabled) {
+        DedupStats stats;
+        if (dedup_tree(staging, new_metadata_path, &stats) == -1) {
+            unlink(new_metadata_path);
+            remove_staging(staging);
+            close(lock_fd);
+            return -1;
+        }
+        printf("[+] Deduplicated %ld files: %ld shared, %ld new, %lld bytes saved.\n",
+               stats.files, stats.linked, stats.added, (long long)stats.bytes_saved);
+    }
+
+    // Swap the new rootfs and record with the old ones, checkouts always find a complete rootfs.
+    // Afterwards staging and the .new record hold the old ones.
+    bool replaced = access(rootfs_path, F_OK) == 0;
+    if (exchange_paths(staging, rootfs_path) == -1) {
+        perror("Error installing rootfs");
+        unlink(new_metadata_path);
+        remove_staging(staging);
+        close(lock_fd);
+        return -1;
+    }
+    bool installed = exchange_paths(new_metadata_path, metadata_path) == 0;
+    if (!installed) {
+        perror("Error installing dedup metadata");
+    }
+    if (!installed || write_file_atomically(manifest_path, manifest) == -1) {
+        // Put the old rootfs back so it keeps matching the stored manifest
+        if (installed) {
+            exchange_paths(new_metadata_path, metadata_path);
+        }
+        exchange_paths(staging, rootfs_path);
+        unlink(new_metadata_path);
+        remove_staging(staging);
+        close(lock_fd);
+        return -1;
+    }
+    unlink(new_metadata_path);
+    close(lock_fd);
+
+    if (replaced) {
+        remove_staging(staging);
+        // The old rootfs may have been the last user of some shared files
+        dedup_gc(NULL);
+    }
+    return 0;
+}
+
+static int pull_into_store(const char *image_name) {
+    if (!valid_image_name(image_name)) {
+        fprintf(stderr, "Invalid image name: %s\n", image_name);
+        return -1;
+    }
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/blobs/sha256", image_store_dir());
+    int created = mkdir_p(path, 0755);
+    snprintf(path, sizeof(path), "%s/tmp", image_store_dir());
+    created |= mkdir_p(path, 0700);
+    snprintf(path, sizeof(path), "%s/images/%s", image_store_dir(), image_name);
+    created |= mkdir_p(path, 0755);
+    if (created == -1) {
+        perror("Error creating image store");
+        return -1;
+    }
+    int pull_lock = lock_store_for_pull();
+    if (pull_lock == -1) {
+        return -1;
+    }
+
+    initialize_curl_global();
+    printf("[*] Pulling %s into %s\n", image_name, image_store_dir());
+
+    char *manifest = get_manifest(image_name);
+    if (!manifest) {
+        fprintf(stderr, "Error retrieving image manifest.\n");
+        cleanup_curl_global();
+        close(pull_lock);
+        return -1;
+    }
+
+    Manifest_parsed_info *manifest_info = parse_manifest(manifest);
+    if (!manifest_info) {
+        fprintf(stderr, "Error parsing image manifest.\n");
+        clean_resources(manifest, NULL);
+        close(pull_lock);
+        return -1;
+    }
+
+    char staging[1024];
+    snprintf(staging, sizeof(staging), "%s/tmp/pull_XXXXXX", image_store_dir());
+    int cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd_fd == -1 || !mkdtemp(staging) || chdir(staging) == -1) {
+        perror("Error creating staging directory");
+        if (cwd_fd != -1) close(cwd_fd);
+        clean_resources(manifest, manifest_info);
+        close(pull_lock);
+        return -1;
+    }
+
+    int result = 0;
+    int i = 0;
+    for (Layer *layer = manifest_info->layersList; layer != NULL && result == 0; layer = layer->next, i++) {
+        char blob[1024];
+        printf("[*] Fetching layer %d\n", i);
+        if (blob_path(layer->digest, blob, sizeof(blob)) == -1 || store_layer_blob(image_name, layer->digest, blob) == -1) {
+            fprintf(stderr, "Error retrieving layer %d.\n", i);
+            result = -1;
+        }
+    }
+
+    if (fchdir(cwd_fd) == -1) {
+        perror("Error changing directory");
+    }
+    close(cwd_fd);
+    remove_staging(staging);
+
+    if (result == 0) {
+        result = unpack_image(image_name, manifest, manifest_info);
+    }
+    if (result == 0) {
+        printf("[+] %s pulled successfully.\n", image_name);
+    }
+
+    clean_resources(manifest, manifest_info);
+    close(pull_lock);
+    return result;
+}
+
+// Resolve, download, verify and unpack an image into the local store
+int image_store_pull(const char *image_name) {
+    int result = pull_into_store(image_name);
+    metrics_count_pull(result == 0);
+    return result;
+}
+
+// Pull every image listed in list_file (one reference per line, '#' starts a comment) from a
+// detached background process running at idle I/O priority. Output goes to the store's prefetch.log.
+int image_store_prefetch(const char *list_file) {
+    FILE *list = fopen(list_file, "r");
+    if (!list) {
+        perror("Error opening image list");
+        return -1;
+    }
+
+    char log_path[1024];
+    snprintf(log_path, sizeof(log_path), "%s/" PREFETCH_LOG, image_store_dir());
+    if (mkdir_p(image_store_dir(), 0755) == -1) {
+        perror("Error creating image store");
+        fclose(list);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Error forking!");
+        fclose(list);
+        return -1;
+    }
+    if (pid > 0) {
+        printf("[*] Prefetching images from %s in the background (pid %d, log %s)\n", list_file, pid, log_path);
+        fclose(list);
+        return 0;
+    }
+
+    setsid();
+    set_background_priority();
+
+    int log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd != -1) {
+        dup2(log_fd, STDOUT_FILENO);
+        dup2(log_fd, STDERR_FILENO);
+        close(log_fd);
+    }
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd != -1) {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+
+    char line[512];
+    int failures = 0;
+    while (fgets(line, sizeof(line), list)) {
+        char *image_name = line;
+        while (isspace((unsigned char)*image_name)) image_name++;
+        char *end = image_name + strcspn(image_name, "# \t\r\n");
+        *end = '\0';
+        if (*image_name == '\0') continue;
+
+        if (image_store_pull(image_name) == -1) {
+            failures++;
+        }
+    }
+    fclose(list);
+    write_metrics();
+    _exit(failures == 0 ? 0 : 1);
+}
+
+// Populate dir_name with a private copy of the stored rootfs
+int image_store_checkout(const char *image_name, const char *dir_name) {
+    char rootfs_path[1024];
+    char lock_path[1024];
+    char metadata_path[1024];
+    image_path(image_name, "rootfs", rootfs_path, sizeof(rootfs_path));
+    image_path(image_name, ".lock", lock_path, sizeof(lock_path));
+    image_path(image_name, DEDUP_METADATA, metadata_path, sizeof(metadata_path));
+
+    // Shared with other checkouts, a pull of the same image waits before swapping the rootfs
+    int lock_fd = open(lock_path, O_RDONLY | O_CLOEXEC);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_SH) == -1) {
+        perror("Error locking image");
+        if (lock_fd != -1) close(lock_fd);
+        return -1;
+    }
+
+    printf("[*] Using local copy of %s.\n", image_name);
+    // The copy keeps hard links: in a deduplicated rootfs those are still only the image's own (see
+    // dedupStore.c). Files that share a store entry then get their own metadata back.
+    int result = copy_tree(rootfs_path, dir_name);
+    if (result == 0 && access(metadata_path, F_OK) == 0) {
+        result = dedup_restore_metadata(metadata_path, dir_name);
+    }
+    close(lock_fd);
+    if (result == -1) {
+        fprintf(stderr, "Error copying rootfs of %s.\n", image_name);
+        return -1;
+    }
+    return 0;
+}
+
+// Drop shared files that no stored rootfs uses any more
+int image_store_gc() {
+    long removed = 0;
+    if (dedup_gc(&removed) == -1) {
+        return -1;
+    }
+    printf("[+] Removed %ld unused files from %s/files.\n", removed, image_store_dir());
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef IMAGESTORE_H
+#define IMAGESTORE_H
+
+#include <stdbool.h>
+
+#define IMAGE_STORE_DIR "/var/lib/ldenv"   // overridden by the LDENV_STORE environment variable
+
+const char *image_store_dir();
+void image_store_set_dedup(bool enabled);
+bool image_store_has(const char *image_name);
+int image_store_pull(const char *image_name);
+int image_store_prefetch(const char *list_file);
+int image_store_checkout(const char *image_name, const char *dir_name);
+int image_store_gc();
+#endif
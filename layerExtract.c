@@ -0,0 +1,1849 @@
+#define _GNU_SOURCE // --> for openat2 / O_PATH and the *at() helpers
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include "layerExtract.h"
+#include "metrics.h"
+#include "networking.h"
+#include "systemUtils.h"
+
+#define EXTRACT_OPTION "--extract="
+#define EXTRACT_JOBS_OPTION "--extract-jobs="
+#define WHITEOUT_PREFIX ".wh."
+#define OPAQUE_WHITEOUT ".wh..wh..opq"
+#define LAYER_DIRS_SUFFIX ".dirs"            // next to a layer's staging directory, see extract_staged_layer()
+#define TAR_BLOCK_SIZE 512
+#define QUEUE_DEPTH 64                        // io_uring SQ entries, also the thread pool queue length
+#define MAX_BUFFERED_BYTES (64 * 1024 * 1024) // file contents held in memory while writes are in flight
+#define LARGE_FILE_SIZE (8 * 1024 * 1024)     // larger files are streamed synchronously
+#define MAX_POOL_THREADS 8
+#define MAX_PENDING_DIRS 16                   // io_uring MKDIRATs in flight
+
+// user_data tags, stored in the low bits of the (16 byte aligned) job or directory pointer
+#define OP_OPEN 0
+#define OP_WRITE 1
+#define OP_CLOSE 2
+#define OP_MKDIR 3
+#define OP_MASK 3
+
+static ExtractBackend extract_backend = EXTRACT_BACKEND_TAR;
+static int extract_jobs = 0;  // 0 = one per online CPU
+
+void set_extract_backend(ExtractBackend backend) {
+    extract_backend = backend;
+}
+
+// Number of layers extracted concurrently, 1 extracts them one after another
+void set_extract_jobs(int jobs) {
+    extract_jobs = jobs;
+}
+
+// Returns 1 if the argument was an --extract= or --extract-jobs= option, 0 if not, -1 if it was malformed
+int parse_extract_option(const char *arg) {
+    if (strncmp(arg, EXTRACT_JOBS_OPTION, strlen(EXTRACT_JOBS_OPTION)) == 0) {
+        const char *value = arg + strlen(EXTRACT_JOBS_OPTION);
+        char *end;
+        long jobs = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || jobs < 1 || jobs > 256) {
+            fprintf(stderr, "Invalid number of extraction jobs: %s\n", value);
+            return -1;
+        }
+        set_extract_jobs((int)jobs);
+        return 1;
+    }
+    if (strncmp(arg, EXTRACT_OPTION, strlen(EXTRACT_OPTION)) != 0) {
+        return 0;
+    }
+    const char *value = arg + strlen(EXTRACT_OPTION);
+    if (strcmp(value, "tar") == 0) {
+        set_extract_backend(EXTRACT_BACKEND_TAR);
+    } else if (strcmp(value, "uring") == 0) {
+        set_extract_backend(EXTRACT_BACKEND_URING);
+    } else if (strcmp(value, "threads") == 0) {
+        set_extract_backend(EXTRACT_BACKEND_THREADS);
+    } else {
+        fprintf(stderr, "Unknown extraction backend: %s (expected tar, uring or threads)\n", value);
+        return -1;
+    }
+    return 1;
+}
+
+//TAR READER
+
+typedef struct TarEntry {
+    char path[PATH_MAX];
+    char link_target[PATH_MAX];
+    char type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    long mtime_nsec;
+    off_t size;
+    unsigned dev_major;
+    unsigned dev_minor;
+} TarEntry;
+
+// Numeric header fields are octal, or base-256 when the high bit of the first byte is set
+static long long tar_number(const char *field, size_t len) {
+    long long value = 0;
+    if ((unsigned char)field[0] & 0x80) {
+        value = (unsigned char)field[0] & 0x7f;
+        for (size_t i = 1; i < len; i++) {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return value;
+    }
+    for (size_t i = 0; i < len && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            value = value * 8 + (field[i] - '0');
+        }
+    }
+    return value;
+}
+
+static int read_exact(FILE *stream, void *buf, size_t len) {
+    return fread(buf, 1, len, stream) == len ? 0 : -1;
+}
+
+static int skip_bytes(FILE *stream, off_t len) {
+    char buf[TAR_BLOCK_SIZE * 16];
+    while (len > 0) {
+        size_t chunk = len > (off_t)sizeof(buf) ? sizeof(buf) : (size_t)len;
+        if (read_exact(stream, buf, chunk) == -1) {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+static off_t padded(off_t size) {
+    return (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+}
+
+// Read a header member's payload (GNU long names, pax records) as a string
+static char *read_payload(FILE *stream, off_t size) {
+    if (size < 0 || size > 16 * 1024 * 1024) {
+        return NULL;
+    }
+    char *data = malloc(padded(size) + 1);
+    if (!data || read_exact(stream, data, padded(size)) == -1) {
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+// Apply "len key=value\n" pax records that override the next header
+static void apply_pax_records(const char *records, off_t size, TarEntry *entry, bool *have_path, bool *have_link, bool *have_size) {
+    const char *p = records;
+    const char *end = records + size;
+    while (p < end) {
+        char *space;
+        long len = strtol(p, &space, 10);
+        if (len <= 0 || *space != ' ' || p + len > end) {
+            return;
+        }
+        const char *key = space + 1;
+        const char *eq = memchr(key, '=', p + len - key);
+        if (eq) {
+            size_t value_len = p + len - 1 - (eq + 1); // drop the trailing newline
+            const char *value = eq + 1;
+            size_t key_len = eq - key;
+            if (key_len == 4 && strncmp(key, "path", 4) == 0 && value_len < sizeof(entry->path)) {
+                memcpy(entry->path, value, value_len);
+                entry->path[value_len] = '\0';
+                *have_path = true;
+            } else if (key_len == 8 && strncmp(key, "linkpath", 8) == 0 && value_len < sizeof(entry->link_target)) {
+                memcpy(entry->link_target, value, value_len);
+                entry->link_target[value_len] = '\0';
+                *have_link = true;
+            } else if (key_len == 4 && strncmp(key, "size", 4) == 0) {
+                entry->size = strtoll(value, NULL, 10);
+                *have_size = true;
+            } else if (key_len == 5 && strncmp(key, "mtime", 5) == 0) {
+                char *fraction;
+                entry->mtime = strtoll(value, &fraction, 10);
+                entry->mtime_nsec = 0;
+                if (*fraction == '.') {
+                    long scale = 100000000;
+                    for (const char *d = fraction + 1; d < value + value_len && *d >= '0' && *d <= '9' && scale > 0; d++) {
+                        entry->mtime_nsec += (*d - '0') * scale;
+                        scale /= 10;
+                    }
+                }
+            } else if (key_len == 3 && strncmp(key, "uid", 3) == 0) {
+                entry->uid = strtol(value, NULL, 10);
+            } else if (key_len == 3 && strncmp(key, "gid", 3) == 0) {
+                entry->gid = strtol(value, NULL, 10);
+            }
+        }
+        p += len;
+    }
+}
+
+// Read the next member header, folding in GNU long name and pax extension headers.
+// Returns 1 for an entry, 0 at the end of the archive, -1 on a malformed archive.
+static int read_tar_entry(FILE *stream, TarEntry *entry) {
+    bool have_path = false, have_link = false, have_size = false;
+    TarEntry pending;
+    memset(&pending, 0, sizeof(pending));
+
+    while (1) {
+        unsigned char header[TAR_BLOCK_SIZE];
+        if (read_exact(stream, header, sizeof(header)) == -1) {
+            return 0; // truncated stream, treat like end of archive
+        }
+
+        bool zero_block = true;
+        for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+            if (header[i]) { zero_block = false; break; }
+        }
+        if (zero_block) {
+            return 0;
+        }
+
+        char type = header[156];
+        off_t size = tar_number((char *)header + 124, 12);
+
+        if (type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+            char *payload = read_payload(stream, size);
+            if (!payload) {
+                return -1;
+            }
+            if (type == 'L' && strlen(payload) < sizeof(pending.path)) {
+                strcpy(pending.path, payload);
+                have_path = true;
+            } else if (type == 'K' && strlen(payload) < sizeof(pending.link_target)) {
+                strcpy(pending.link_target, payload);
+                have_link = true;
+            } else if (type == 'x') {
+                apply_pax_records(payload, size, &pending, &have_path, &have_link, &have_size);
+            }
+            free(payload);
+            continue;
+        }
+
+        *entry = pending;
+        entry->type = type ? type : '0';
+        if (!have_path) {
+            char name[101], prefix[156];
+            memcpy(name, header, 100);
+            name[100] = '\0';
+            memcpy(prefix, header + 345, 155);
+            prefix[155] = '\0';
+            if (memcmp(header + 257, "ustar", 5) == 0 && prefix[0]) {
+                snprintf(entry->path, sizeof(entry->path), "%s/%s", prefix, name);
+            } else {
+                strcpy(entry->path, name);
+            }
+        }
+        if (!have_link) {
+            memcpy(entry->link_target, header + 157, 100);
+            entry->link_target[100] = '\0';
+        }
+        if (!have_size) {
+            entry->size = size;
+        }
+        entry->mode = tar_number((char *)header + 100, 8) & 07777;
+        if (!entry->uid) entry->uid = tar_number((char *)header + 108, 8);
+        if (!entry->gid) entry->gid = tar_number((char *)header + 116, 8);
+        if (!entry->mtime) entry->mtime = tar_number((char *)header + 136, 12);
+        entry->dev_major = tar_number((char *)header + 329, 8);
+        entry->dev_minor = tar_number((char *)header + 337, 8);
+        return 1;
+    }
+}
+
+// Strip leading "./" and "/" and trailing slashes, reject paths that climb out of the root
+static int normalize_path(char *path) {
+    char *start = path;
+    while (1) {
+        if (start[0] == '/') start++;
+        else if (start[0] == '.' && start[1] == '/') start += 2;
+        else break;
+    }
+    if (strcmp(start, ".") == 0) start += 1;
+    memmove(path, start, strlen(start) + 1);
+
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') {
+        path[--len] = '\0';
+    }
+
+    for (const char *p = path; *p; ) {
+        const char *slash = strchr(p, '/');
+        size_t part = slash ? (size_t)(slash - p) : strlen(p);
+        if (part == 2 && p[0] == '.' && p[1] == '.') {
+            return -1;
+        }
+        p += part;
+        while (*p == '/') p++;
+    }
+    return 0;
+}
+
+//WRITER
+
+typedef struct FileJob {
+    char *path;
+    char *data;
+    size_t size;
+    size_t written;
+    mode_t mode;
+    int fd;
+    int error;
+    bool retried;
+    struct open_how how;
+    struct FileJob *next;
+} __attribute__((aligned(16))) FileJob;
+
+// A directory whose IORING_OP_MKDIRAT is in flight. Regular files going straight into it wait in
+// waiters and are opened once it exists, anything else below it waits for the completion.
+typedef struct PendingDir {
+    char *path;
+    int parent_fd;        // own descriptor, the kernel only resolves it when the MKDIRAT runs
+    mode_t mode;
+    FileJob *waiters;
+    struct PendingDir *next;
+} __attribute__((aligned(16))) PendingDir;
+
+// Metadata applied once all entries of the layer exist
+typedef struct Fixup {
+    char *path;
+    char *target;   // link target for hard and symbolic links
+    char type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    long mtime_nsec;
+} Fixup;
+
+typedef struct FixupList {
+    Fixup *items;
+    size_t count;
+    size_t capacity;
+} FixupList;
+
+typedef struct Uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+    unsigned sq_entries;
+    unsigned to_submit;
+} Uring;
+
+typedef struct Extractor {
+    int root_fd;
+    bool is_root;
+    int errors;
+
+    // Last resolved parent directory
+    char parent_path[PATH_MAX];
+    int parent_fd;
+
+    bool use_uring;
+    Uring ring;
+    int files_inflight;
+    size_t buffered_bytes;
+    PendingDir *pending_dirs;
+    int dirs_inflight;
+    int files_behind_dirs;   // files_inflight still waiting for their directory
+
+    pthread_t threads[MAX_POOL_THREADS];
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready, space_ready, idle;
+    FileJob *queue_head, *queue_tail;
+    int queued, active;
+    bool stopping;
+
+    FixupList fixups;
+    FixupList dirs;
+    FixupList hardlinks;
+    FixupList symlinks;
+} Extractor;
+
+static void report_error(Extractor *ext, const char *path, int err) {
+    fprintf(stderr, "Error extracting %s: %s\n", path, strerror(err));
+    __atomic_add_fetch(&ext->errors, 1, __ATOMIC_RELAXED);
+}
+
+static int add_fixup(FixupList *list, const TarEntry *entry) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        Fixup *items = realloc(list->items, capacity * sizeof(Fixup));
+        if (!items) {
+            return -1;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    Fixup *fixup = &list->items[list->count];
+    fixup->path = strdup(entry->path);
+    fixup->target = entry->link_target[0] ? strdup(entry->link_target) : NULL;
+    fixup->type = entry->type;
+    fixup->mode = entry->mode;
+    fixup->uid = entry->uid;
+    fixup->gid = entry->gid;
+    fixup->mtime = entry->mtime;
+    fixup->mtime_nsec = entry->mtime_nsec;
+    if (!fixup->path) {
+        return -1;
+    }
+    list->count++;
+    return 0;
+}
+
+static void free_fixups(FixupList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->items[i].path);
+        free(list->items[i].target);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+// Open the parent directory of path without letting symlinks escape the root.
+// On success *base points at the last component of path.
+static int open_parent(int root_fd, const char *path, const char **base) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        *base = path[0] ? path : ".";
+        return dup(root_fd);
+    }
+    *base = slash + 1;
+
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%.*s", (int)(slash - path), path);
+    struct open_how how = {
+        .flags = O_PATH | O_DIRECTORY | O_CLOEXEC,
+        .resolve = RESOLVE_IN_ROOT,
+    };
+    return syscall(SYS_openat2, root_fd, parent, &how, sizeof(how));
+}
+
+// Create the missing parent directories of path with mode 0755, the way tar does for entries that
+// come without a header for their directory
+static int make_parents(int root_fd, const char *path) {
+    char parent[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    snprintf(parent, sizeof(parent), "%.*s", slash ? (int)(slash - path) : 0, path);
+
+    for (char *p = parent; ; p++) {
+        if (*p != '/' && *p != '\0') continue;
+        char saved = *p;
+        *p = '\0';
+        const char *base;
+        int dir_fd = open_parent(root_fd, parent, &base);
+        if (dir_fd == -1) {
+            return -1;
+        }
+        int res = mkdirat(dir_fd, base, 0755);
+        int err = errno;
+        close(dir_fd);
+        if (res == -1 && err != EEXIST) {
+            errno = err;
+            return -1;
+        }
+        *p = saved;
+        if (saved == '\0') return 0;
+    }
+}
+
+// Cached variant for the producer thread, entries of one directory usually come together
+static int producer_parent(Extractor *ext, const char *path, const char **base) {
+    const char *slash = strrchr(path, '/');
+    size_t parent_len = slash ? (size_t)(slash - path) : 0;
+
+    if (ext->parent_fd != -1 && strlen(ext->parent_path) == parent_len && strncmp(ext->parent_path, path, parent_len) == 0) {
+        *base = slash ? slash + 1 : (path[0] ? path : ".");
+        return ext->parent_fd;
+    }
+    if (ext->parent_fd != -1) {
+        close(ext->parent_fd);
+        ext->parent_fd = -1;
+    }
+
+    int fd = open_parent(ext->root_fd, path, base);
+    if (fd == -1 && errno == ENOENT && slash && make_parents(ext->root_fd, path) == 0) {
+        fd = open_parent(ext->root_fd, path, base);
+    }
+    if (fd != -1) {
+        snprintf(ext->parent_path, sizeof(ext->parent_path), "%.*s", (int)parent_len, path);
+        ext->parent_fd = fd;
+    }
+    return fd;
+}
+
+static void remove_existing(int root_fd, const char *path) {
+    const char *base;
+    int dir_fd = open_parent(root_fd, path, &base);
+    if (dir_fd == -1) {
+        return;
+    }
+    if (unlinkat(dir_fd, base, 0) == -1 && (errno == EISDIR || errno == EPERM)) {
+        unlinkat(dir_fd, base, AT_REMOVEDIR);
+    }
+    close(dir_fd);
+}
+
+static void finish_job(Extractor *ext, FileJob *job) {
+    if (ext->use_uring) {
+        ext->files_inflight--;
+        ext->buffered_bytes -= job->size;
+    }
+    free(job->data);
+    free(job->path);
+    free(job);
+}
+
+//IO_URING BACKEND
+
+static int uring_setup(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+        munmap(ring->sq_ptr, ring->sq_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ptr;
+    char *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sq_entries = params.sq_entries;
+    return 0;
+}
+
+static void uring_teardown(Uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+// Check that the kernel knows every opcode the extractor submits
+static bool uring_supports_ops(Uring *ring) {
+    size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (!probe) {
+        return false;
+    }
+    bool supported = false;
+    if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+        const int needed[] = { IORING_OP_OPENAT2, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_MKDIRAT };
+        supported = true;
+        for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+            if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+                supported = false;
+            }
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+static int uring_enter(Uring *ring, unsigned wait_nr) {
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    while (1) {
+        int ret = syscall(SYS_io_uring_enter, ring->fd, ring->to_submit, wait_nr, flags, NULL, 0);
+        if (ret >= 0) {
+            unsigned submitted = ret;
+            ring->to_submit -= submitted < ring->to_submit ? submitted : ring->to_submit;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    // The queue bounds keep completions from overflowing, so handing the queued
+    // SQEs to the kernel is enough to free slots
+    while (tail - head >= ring->sq_entries) {
+        uring_enter(ring, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    }
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+static void uring_queue_open(Extractor *ext, FileJob *job) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ext->ring);
+    sqe->opcode = IORING_OP_OPENAT2;
+    sqe->fd = ext->root_fd;
+    sqe->addr = (uintptr_t)job->path;
+    sqe->len = sizeof(job->how);
+    sqe->off = (uintptr_t)&job->how;
+    sqe->user_data = (uintptr_t)job | OP_OPEN;
+}
+
+// Write the rest of the file, with the close linked behind it
+static void uring_queue_write_close(Extractor *ext, FileJob *job) {
+    if (job->written < job->size) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&ext->ring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = job->fd;
+        sqe->addr = (uintptr_t)(job->data + job->written);
+        sqe->len = job->size - job->written;
+        sqe->off = job->written;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (uintptr_t)job | OP_WRITE;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(&ext->ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = job->fd;
+    sqe->user_data = (uintptr_t)job | OP_CLOSE;
+}
+
+static void uring_queue_mkdir(Extractor *ext, PendingDir *dir) {
+    const char *base = strrchr(dir->path, '/');
+    struct io_uring_sqe *sqe = uring_get_sqe(&ext->ring);
+    sqe->opcode = IORING_OP_MKDIRAT;
+    sqe->fd = dir->parent_fd;
+    sqe->addr = (uintptr_t)(base ? base + 1 : dir->path);
+    sqe->len = dir->mode;
+    sqe->user_data = (uintptr_t)dir | OP_MKDIR;
+}
+
+// The directory exists (or failed), queue the opens that were waiting for it
+static void uring_finish_mkdir(Extractor *ext, PendingDir *dir, int res) {
+    const char *base = strrchr(dir->path, '/');
+    base = base ? base + 1 : dir->path;
+    if (res == -EEXIST) {
+        struct stat st;
+        if (fstatat(dir->parent_fd, base, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+            res = 0;
+        } else {
+            remove_existing(ext->root_fd, dir->path);
+            res = mkdirat(dir->parent_fd, base, dir->mode) == -1 ? -errno : 0;
+        }
+    }
+    if (res < 0) {
+        report_error(ext, dir->path, -res);
+    }
+
+    PendingDir **link = &ext->pending_dirs;
+    while (*link != dir) link = &(*link)->next;
+    *link = dir->next;
+    ext->dirs_inflight--;
+
+    while (dir->waiters) {
+        FileJob *job = dir->waiters;
+        dir->waiters = job->next;
+        ext->files_behind_dirs--;
+        uring_queue_open(ext, job);
+    }
+    close(dir->parent_fd);
+    free(dir->path);
+    free(dir);
+}
+
+static void uring_handle_completion(Extractor *ext, struct io_uring_cqe *cqe) {
+    int op = cqe->user_data & OP_MASK;
+    FileJob *job = (FileJob *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    int res = cqe->res;
+
+    switch (op) {
+        case OP_MKDIR:
+            uring_finish_mkdir(ext, (PendingDir *)job, res);
+            break;
+        case OP_OPEN:
+            if (res == -EEXIST && !job->retried) {
+                job->retried = true;
+                remove_existing(ext->root_fd, job->path);
+                uring_queue_open(ext, job);
+            } else if (res < 0) {
+                report_error(ext, job->path, -res);
+                finish_job(ext, job);
+            } else {
+                job->fd = res;
+                uring_queue_write_close(ext, job);
+            }
+            break;
+        case OP_WRITE:
+            if (res < 0) {
+                job->error = -res;
+            } else {
+                job->written += res;
+            }
+            break;
+        case OP_CLOSE:
+            if (res == -ECANCELED) {
+                // The linked write failed or was short
+                if (job->error || job->written >= job->size) {
+                    close(job->fd);
+                    report_error(ext, job->path, job->error ? job->error : EIO);
+                    finish_job(ext, job);
+                } else {
+                    uring_queue_write_close(ext, job);
+                }
+            } else {
+                if (res < 0) {
+                    report_error(ext, job->path, -res);
+                }
+                finish_job(ext, job);
+            }
+            break;
+    }
+}
+
+// Submit queued SQEs, wait for at least wait_nr completions and process everything available
+static int uring_reap(Extractor *ext, unsigned wait_nr) {
+    Uring *ring = &ext->ring;
+    if (uring_enter(ring, wait_nr) == -1) {
+        perror("io_uring_enter");
+        return -1;
+    }
+
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        uring_handle_completion(ext, &cqe);
+    }
+    return 0;
+}
+
+// The pending directory path is or lies below, NULL when there is none
+static PendingDir *pending_dir_above(Extractor *ext, const char *path) {
+    for (PendingDir *dir = ext->pending_dirs; dir; dir = dir->next) {
+        size_t len = strlen(dir->path);
+        if (strncmp(path, dir->path, len) == 0 && (path[len] == '\0' || path[len] == '/')) {
+            return dir;
+        }
+    }
+    return NULL;
+}
+
+// The pending directory a regular file at path goes straight into, NULL when there is none
+static PendingDir *pending_parent(Extractor *ext, const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        return NULL;
+    }
+    for (PendingDir *dir = ext->pending_dirs; dir; dir = dir->next) {
+        if (strlen(dir->path) == (size_t)(slash - path) && strncmp(path, dir->path, slash - path) == 0) {
+            return dir;
+        }
+    }
+    return NULL;
+}
+
+static int uring_wait_for_dirs(Extractor *ext, const char *path) {
+    while (pending_dir_above(ext, path)) {
+        if (uring_reap(ext, 1) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int uring_drain(Extractor *ext) {
+    while (ext->files_inflight > 0 || ext->pending_dirs) {
+        if (uring_reap(ext, 1) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//THREAD POOL BACKEND
+
+static int open_in_root(int root_fd, const char *path, struct open_how *how) {
+    return syscall(SYS_openat2, root_fd, path, how, sizeof(*how));
+}
+
+static void pool_write_file(Extractor *ext, FileJob *job) {
+    int fd = open_in_root(ext->root_fd, job->path, &job->how);
+    if (fd == -1 && errno == EEXIST) {
+        remove_existing(ext->root_fd, job->path);
+        fd = open_in_root(ext->root_fd, job->path, &job->how);
+    }
+    if (fd == -1) {
+        report_error(ext, job->path, errno);
+        return;
+    }
+    while (job->written < job->size) {
+        ssize_t n = write(fd, job->data + job->written, job->size - job->written);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) continue;
+            report_error(ext, job->path, n == 0 ? EIO : errno);
+            break;
+        }
+        job->written += n;
+    }
+    close(fd);
+}
+
+static void *pool_worker(void *arg) {
+    Extractor *ext = arg;
+    pthread_mutex_lock(&ext->lock);
+    while (1) {
+        while (!ext->queue_head && !ext->stopping) {
+            pthread_cond_wait(&ext->job_ready, &ext->lock);
+        }
+        if (!ext->queue_head) {
+            break;
+        }
+        FileJob *job = ext->queue_head;
+        ext->queue_head = job->next;
+        if (!ext->queue_head) ext->queue_tail = NULL;
+        ext->queued--;
+        ext->active++;
+        pthread_cond_signal(&ext->space_ready);
+        pthread_mutex_unlock(&ext->lock);
+
+        pool_write_file(ext, job);
+        finish_job(ext, job);
+
+        pthread_mutex_lock(&ext->lock);
+        ext->active--;
+        if (!ext->queue_head && ext->active == 0) {
+            pthread_cond_broadcast(&ext->idle);
+        }
+    }
+    pthread_mutex_unlock(&ext->lock);
+    return NULL;
+}
+
+static int pool_start(Extractor *ext) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 2 ? 2 : (cpus > MAX_POOL_THREADS ? MAX_POOL_THREADS : (int)cpus);
+
+    pthread_mutex_init(&ext->lock, NULL);
+    pthread_cond_init(&ext->job_ready, NULL);
+    pthread_cond_init(&ext->space_ready, NULL);
+    pthread_cond_init(&ext->idle, NULL);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&ext->threads[i], NULL, pool_worker, ext) != 0) {
+            break;
+        }
+        ext->thread_count++;
+    }
+    return ext->thread_count > 0 ? 0 : -1;
+}
+
+static void pool_drain(Extractor *ext) {
+    pthread_mutex_lock(&ext->lock);
+    while (ext->queue_head || ext->active > 0) {
+        pthread_cond_wait(&ext->idle, &ext->lock);
+    }
+    pthread_mutex_unlock(&ext->lock);
+}
+
+static void pool_stop(Extractor *ext) {
+    pthread_mutex_lock(&ext->lock);
+    ext->stopping = true;
+    pthread_cond_broadcast(&ext->job_ready);
+    pthread_mutex_unlock(&ext->lock);
+    for (int i = 0; i < ext->thread_count; i++) {
+        pthread_join(ext->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&ext->lock);
+    pthread_cond_destroy(&ext->job_ready);
+    pthread_cond_destroy(&ext->space_ready);
+    pthread_cond_destroy(&ext->idle);
+}
+
+//EXTRACTION
+
+static int drain_writes(Extractor *ext) {
+    if (ext->use_uring) {
+        return uring_drain(ext);
+    }
+    pool_drain(ext);
+    return 0;
+}
+
+// Hand a fully buffered file to the active backend, which takes ownership of it
+static int submit_file(Extractor *ext, FileJob *job) {
+    job->how.flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    job->how.mode = job->mode;
+    job->how.resolve = RESOLVE_IN_ROOT;
+
+    if (ext->use_uring) {
+        // Every submitted file still owes at least one completion, so once the queue is full wait
+        // for half of them in one io_uring_enter() rather than one by one
+        while (ext->files_inflight > 0 &&
+               (ext->files_inflight >= (int)ext->ring.sq_entries / 2 || ext->buffered_bytes + job->size > MAX_BUFFERED_BYTES)) {
+            int submitted = ext->files_inflight - ext->files_behind_dirs;
+            if (uring_reap(ext, submitted > 1 ? submitted / 2 : 1) == -1) {
+                return -1;
+            }
+        }
+        ext->files_inflight++;
+        ext->buffered_bytes += job->size;
+        PendingDir *parent = pending_parent(ext, job->path);
+        if (parent) {
+            job->next = parent->waiters;
+            parent->waiters = job;
+            ext->files_behind_dirs++;
+            return 0;
+        }
+        uring_queue_open(ext, job);
+        if (ext->ring.to_submit >= ext->ring.sq_entries / 2) {
+            return uring_reap(ext, 0);
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&ext->lock);
+    while (ext->queued >= QUEUE_DEPTH) {
+        pthread_cond_wait(&ext->space_ready, &ext->lock);
+    }
+    job->next = NULL;
+    if (ext->queue_tail) ext->queue_tail->next = job;
+    else ext->queue_head = job;
+    ext->queue_tail = job;
+    ext->queued++;
+    pthread_cond_signal(&ext->job_ready);
+    pthread_mutex_unlock(&ext->lock);
+    return 0;
+}
+
+// Files too large to buffer are streamed to disk from the producer once earlier writes are done
+static int stream_large_file(Extractor *ext, const TarEntry *entry, FILE *stream) {
+    if (drain_writes(ext) == -1) {
+        return -1;
+    }
+    struct open_how how = {
+        .flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+        .mode = entry->mode,
+        .resolve = RESOLVE_IN_ROOT,
+    };
+    int fd = open_in_root(ext->root_fd, entry->path, &how);
+    if (fd == -1 && errno == EEXIST) {
+        remove_existing(ext->root_fd, entry->path);
+        fd = open_in_root(ext->root_fd, entry->path, &how);
+    }
+    if (fd == -1) {
+        report_error(ext, entry->path, errno);
+    }
+
+    char buf[65536];
+    off_t left = entry->size;
+    while (left > 0) {
+        size_t chunk = left > (off_t)sizeof(buf) ? sizeof(buf) : (size_t)left;
+        if (read_exact(stream, buf, chunk) == -1) {
+            if (fd != -1) close(fd);
+            return -1;
+        }
+        if (fd != -1 && write(fd, buf, chunk) != (ssize_t)chunk) {
+            report_error(ext, entry->path, errno ? errno : EIO);
+            close(fd);
+            fd = -1;
+        }
+        left -= chunk;
+    }
+    if (fd != -1) close(fd);
+    return skip_bytes(stream, padded(entry->size) - entry->size);
+}
+
+static int extract_regular_file(Extractor *ext, const TarEntry *entry, FILE *stream) {
+    if (entry->size > LARGE_FILE_SIZE) {
+        return stream_large_file(ext, entry, stream);
+    }
+
+    FileJob *job = calloc(1, sizeof(FileJob));
+    if (!job) {
+        return -1;
+    }
+    job->path = strdup(entry->path);
+    job->size = entry->size;
+    job->mode = entry->mode;
+    job->fd = -1;
+    job->data = malloc(padded(entry->size) ? padded(entry->size) : 1);
+    if (!job->path || !job->data || read_exact(stream, job->data, padded(entry->size)) == -1) {
+        free(job->path);
+        free(job->data);
+        free(job);
+        return -1;
+    }
+    return submit_file(ext, job);
+}
+
+static int make_directory(Extractor *ext, const TarEntry *entry) {
+    if (entry->path[0] == '\0') {
+        return 0; // the root itself, only needs its metadata
+    }
+
+    const char *base;
+    int dir_fd = producer_parent(ext, entry->path, &base);
+    if (dir_fd == -1) {
+        report_error(ext, entry->path, errno);
+        return 0;
+    }
+
+    // Keep the directory writable for its own entries, the real mode is applied at the end
+    mode_t mode = entry->mode | S_IRWXU;
+    if (ext->use_uring) {
+        // Not waited for here: the files that go into it are queued behind it
+        while (ext->dirs_inflight >= MAX_PENDING_DIRS) {
+            if (uring_reap(ext, 1) == -1) {
+                return -1;
+            }
+        }
+        PendingDir *dir = calloc(1, sizeof(PendingDir));
+        if (!dir || !(dir->path = strdup(entry->path)) || (dir->parent_fd = dup(dir_fd)) == -1) {
+            if (dir) free(dir->path);
+            free(dir);
+            return -1;
+        }
+        dir->mode = mode;
+        dir->next = ext->pending_dirs;
+        ext->pending_dirs = dir;
+        ext->dirs_inflight++;
+        uring_queue_mkdir(ext, dir);
+        if (ext->ring.to_submit >= ext->ring.sq_entries / 2) {
+            return uring_reap(ext, 0);
+        }
+        return 0;
+    }
+    int res = mkdirat(dir_fd, base, mode) == -1 ? -errno : 0;
+
+    if (res == -EEXIST) {
+        struct stat st;
+        if (fstatat(dir_fd, base, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+            return 0;
+        }
+        remove_existing(ext->root_fd, entry->path);
+        res = mkdirat(dir_fd, base, mode) == -1 ? -errno : 0;
+    }
+    if (res < 0) {
+        report_error(ext, entry->path, -res);
+    }
+    return 0;
+}
+
+static int make_special(Extractor *ext, const TarEntry *entry) {
+    const char *base;
+    int dir_fd = producer_parent(ext, entry->path, &base);
+    if (dir_fd == -1) {
+        report_error(ext, entry->path, errno);
+        return 0;
+    }
+
+    mode_t type = entry->type == '3' ? S_IFCHR : entry->type == '4' ? S_IFBLK : S_IFIFO;
+    dev_t dev = makedev(entry->dev_major, entry->dev_minor);
+    if (mknodat(dir_fd, base, type | entry->mode, dev) == -1 && errno == EEXIST) {
+        remove_existing(ext->root_fd, entry->path);
+        if (mknodat(dir_fd, base, type | entry->mode, dev) == -1) {
+            report_error(ext, entry->path, errno);
+        }
+    }
+    return 0;
+}
+
+static void apply_ownership_and_mode(Extractor *ext, int dir_fd, const char *base, const Fixup *fixup) {
+    bool chowned = false;
+    if (ext->is_root && (fixup->uid != 0 || fixup->gid != 0)) {
+        if (fchownat(dir_fd, base, fixup->uid, fixup->gid, AT_SYMLINK_NOFOLLOW) == -1) {
+            report_error(ext, fixup->path, errno);
+        }
+        chowned = true;
+    }
+    // chown clears set-id bits, directories were created with extra owner bits
+    if (fixup->type != '2' && (fixup->type == '5' || (chowned && (fixup->mode & 06000)))) {
+        if (fchmodat(dir_fd, base, fixup->mode, 0) == -1) {
+            report_error(ext, fixup->path, errno);
+        }
+    }
+}
+
+static void apply_mtime(int dir_fd, const char *base, const Fixup *fixup) {
+    struct timespec times[2] = {
+        { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+        { .tv_sec = fixup->mtime, .tv_nsec = fixup->mtime_nsec },
+    };
+    utimensat(dir_fd, base, times, AT_SYMLINK_NOFOLLOW);
+}
+
+static void apply_fixups(Extractor *ext, FixupList *list, bool with_mtime) {
+    for (size_t i = 0; i < list->count; i++) {
+        const Fixup *fixup = &list->items[i];
+        const char *base;
+        int dir_fd = producer_parent(ext, fixup->path, &base);
+        if (dir_fd == -1) continue;
+
+        struct stat st;
+        if (fstatat(dir_fd, base, &st, AT_SYMLINK_NOFOLLOW) == -1 || (S_ISLNK(st.st_mode) && fixup->type != '2')) {
+            continue; // replaced by a symlink, never follow it
+        }
+        apply_ownership_and_mode(ext, dir_fd, base, fixup);
+        if (with_mtime) apply_mtime(dir_fd, base, fixup);
+    }
+}
+
+// Links are created after every regular file exists, symlinks last so that no
+// entry of the layer is ever written through a link the layer itself created
+static void finish_links(Extractor *ext) {
+    for (size_t i = 0; i < ext->hardlinks.count; i++) {
+        const Fixup *link = &ext->hardlinks.items[i];
+        if (!link->target || normalize_path(link->target) == -1) {
+            report_error(ext, link->path, EINVAL);
+            continue;
+        }
+
+        const char *target_base, *base;
+        int target_fd = open_parent(ext->root_fd, link->target, &target_base);
+        int dir_fd = open_parent(ext->root_fd, link->path, &base);
+        if (target_fd != -1 && dir_fd != -1) {
+            if (linkat(target_fd, target_base, dir_fd, base, 0) == -1 && errno == EEXIST) {
+                unlinkat(dir_fd, base, 0);
+                if (linkat(target_fd, target_base, dir_fd, base, 0) == -1) {
+                    report_error(ext, link->path, errno);
+                }
+            }
+        } else {
+            report_error(ext, link->path, errno);
+        }
+        if (target_fd != -1) close(target_fd);
+        if (dir_fd != -1) close(dir_fd);
+    }
+
+    apply_fixups(ext, &ext->fixups, true);
+    apply_fixups(ext, &ext->dirs, false);
+
+    for (size_t i = 0; i < ext->symlinks.count; i++) {
+        const Fixup *link = &ext->symlinks.items[i];
+        const char *base;
+        int dir_fd = producer_parent(ext, link->path, &base);
+        if (dir_fd == -1) {
+            report_error(ext, link->path, errno);
+            continue;
+        }
+        if (symlinkat(link->target ? link->target : "", dir_fd, base) == -1 && errno == EEXIST) {
+            remove_existing(ext->root_fd, link->path);
+            if (symlinkat(link->target ? link->target : "", dir_fd, base) == -1) {
+                report_error(ext, link->path, errno);
+                continue;
+            }
+        }
+        apply_ownership_and_mode(ext, dir_fd, base, link);
+        apply_mtime(dir_fd, base, link);
+    }
+
+    // Directory times last, creating the links above touched them
+    for (size_t i = ext->dirs.count; i > 0; i--) {
+        const Fixup *dir = &ext->dirs.items[i - 1];
+        const char *base;
+        int dir_fd = producer_parent(ext, dir->path, &base);
+        struct stat st;
+        if (dir_fd != -1 && fstatat(dir_fd, base, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+            apply_mtime(dir_fd, base, dir);
+        }
+    }
+}
+
+static int extract_entries(Extractor *ext, FILE *stream) {
+    TarEntry entry;
+    int ret;
+    while ((ret = read_tar_entry(stream, &entry)) == 1) {
+        if (normalize_path(entry.path) == -1) {
+            fprintf(stderr, "Skipping unsafe path %s\n", entry.path);
+            if (skip_bytes(stream, padded(entry.size)) == -1) return -1;
+            continue;
+        }
+
+        // Files are opened by path from the writers, make sure their directory exists first. With
+        // io_uring, a regular file going straight into a directory being created is queued behind it,
+        // anything else below a pending directory waits for it.
+        bool regular = entry.type == '0' || entry.type == '7';
+        if (ext->use_uring && !(regular && pending_parent(ext, entry.path)) && uring_wait_for_dirs(ext, entry.path) == -1) {
+            return -1;
+        }
+        const char *base;
+        if (!ext->use_uring || !pending_parent(ext, entry.path)) {
+            producer_parent(ext, entry.path, &base);
+        }
+
+        int result = 0;
+        switch (entry.type) {
+            case '0':
+            case '7':
+                if (entry.path[0] == '\0') { result = skip_bytes(stream, padded(entry.size)); break; }
+                result = extract_regular_file(ext, &entry, stream);
+                if (result == 0 && add_fixup(&ext->fixups, &entry) == -1) result = -1;
+                break;
+            case '5':
+                result = make_directory(ext, &entry);
+                if (result == 0 && add_fixup(&ext->dirs, &entry) == -1) result = -1;
+                if (result == 0) result = skip_bytes(stream, padded(entry.size));
+                break;
+            case '1':
+                result = add_fixup(&ext->hardlinks, &entry);
+                break;
+            case '2':
+                result = add_fixup(&ext->symlinks, &entry);
+                break;
+            case '3':
+            case '4':
+            case '6':
+                result = make_special(ext, &entry);
+                if (result == 0 && add_fixup(&ext->fixups, &entry) == -1) result = -1;
+                break;
+            default:
+                result = skip_bytes(stream, padded(entry.size));
+                break;
+        }
+        if (result == -1) {
+            return -1;
+        }
+    }
+    return ret;
+}
+
+// Decompress through gzip (or zstd), both pass plain tar through untouched
+static FILE *open_layer_stream(const char *tarball) {
+    unsigned char magic[4] = {0};
+    FILE *fp = fopen(tarball, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    size_t n = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+
+    char command[PATH_MAX + 64];
+    if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+        snprintf(command, sizeof(command), "zstd -dc '%s'", tarball);
+    } else {
+        snprintf(command, sizeof(command), "gzip -dcf '%s'", tarball);
+    }
+    return popen(command, "r");
+}
+
+// Write a directory path to a layer's directory list, paths are NUL separated
+static void list_layer_dir(FILE *dirs_list, const char *path) {
+    fwrite(path, 1, strlen(path) + 1, dirs_list);
+}
+
+// With dirs_list, the directories that came with a header are written to it
+static int extract_layer_native(const char *tarball, const char *dest_dir, FILE *dirs_list) {
+    Extractor *ext = calloc(1, sizeof(Extractor));
+    if (!ext) {
+        return -1;
+    }
+    ext->parent_fd = -1;
+    ext->is_root = geteuid() == 0;
+    ext->root_fd = open(dest_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (ext->root_fd == -1) {
+        perror("Error opening extraction directory");
+        free(ext);
+        return -1;
+    }
+
+    if (extract_backend == EXTRACT_BACKEND_URING && uring_setup(&ext->ring, QUEUE_DEPTH) == 0) {
+        if (uring_supports_ops(&ext->ring)) {
+            ext->use_uring = true;
+        } else {
+            uring_teardown(&ext->ring);
+        }
+    }
+    if (!ext->use_uring && pool_start(ext) == -1) {
+        fprintf(stderr, "Could not start extraction threads\n");
+        close(ext->root_fd);
+        free(ext);
+        return -1;
+    }
+    printf("[*] Extracting %s with %s.\n", tarball, ext->use_uring ? "io_uring" : "a thread pool");
+
+    mode_t old_umask = umask(0);
+    int result = -1;
+    FILE *stream = open_layer_stream(tarball);
+    if (stream) {
+        result = extract_entries(ext, stream);
+        if (drain_writes(ext) == -1) {
+            result = -1;
+        }
+        if (pclose(stream) != 0) {
+            fprintf(stderr, "Error decompressing %s\n", tarball);
+            result = -1;
+        }
+    } else {
+        perror("Error opening layer");
+    }
+    if (result != -1) {
+        finish_links(ext);
+    }
+    umask(old_umask);
+    for (size_t i = 0; dirs_list && result != -1 && i < ext->dirs.count; i++) {
+        if (ext->dirs.items[i].path[0] != '\0') {
+            list_layer_dir(dirs_list, ext->dirs.items[i].path);
+        }
+    }
+
+    if (ext->use_uring) {
+        uring_teardown(&ext->ring);
+    } else {
+        pool_stop(ext);
+    }
+    if (ext->parent_fd != -1) close(ext->parent_fd);
+    close(ext->root_fd);
+    free_fixups(&ext->fixups);
+    free_fixups(&ext->dirs);
+    free_fixups(&ext->hardlinks);
+    free_fixups(&ext->symlinks);
+    if (ext->errors > 0) {
+        result = -1;
+    }
+    free(ext);
+    return result == -1 ? -1 : 0;
+}
+
+// Extract one layer archive into dest_dir with the selected backend
+int extract_layer(const char *tarball, const char *dest_dir) {
+    if (extract_backend == EXTRACT_BACKEND_TAR) {
+        return untar_to_directory(tarball, dest_dir);
+    }
+    return extract_layer_native(tarball, dest_dir, NULL);
+}
+
+//LAYER MERGE
+
+// Paths of the directories that have a header of their own in one layer, sorted for bsearch()
+typedef struct LayerDirs {
+    char *data;
+    char **paths;
+    size_t count;
+} LayerDirs;
+
+typedef struct MergeContext {
+    int root_fd;              // the merged tree, lower symlinks are resolved inside it
+    const LayerDirs *dirs;
+    char path[PATH_MAX];      // path of the directory being merged, relative to the layer root
+} MergeContext;
+
+// Everything read from source is copied to sink, so tar gets the layer the header scan reads
+typedef struct TeeStream {
+    FILE *source;
+    FILE *sink;
+    bool failed;
+} TeeStream;
+
+static ssize_t tee_read(void *cookie, char *buf, size_t size) {
+    TeeStream *tee = cookie;
+    size_t n = fread(buf, 1, size, tee->source);
+    if (n > 0 && !tee->failed && fwrite(buf, 1, n, tee->sink) != n) {
+        tee->failed = true; // tar gave up, keep reading so the scan still finishes
+    }
+    return ferror(tee->source) ? -1 : (ssize_t)n;
+}
+
+// The tar backend for extract_staged_layer(): the layer is decompressed once, piped into tar and
+// scanned for directory headers on the way
+static int untar_listing_dirs(const char *tarball, const char *staging, FILE *dirs_list) {
+    char command[PATH_MAX + 64];
+    snprintf(command, sizeof(command), "tar -xf - -C '%s'", staging);
+    struct sigaction ignore = { .sa_handler = SIG_IGN }, old_action;
+    sigaction(SIGPIPE, &ignore, &old_action);
+
+    FILE *stream = open_layer_stream(tarball);
+    FILE *tar = stream ? popen(command, "w") : NULL;
+    TeeStream tee = { stream, tar, false };
+    FILE *tee_stream = tar ? fopencookie(&tee, "r", (cookie_io_functions_t){ .read = tee_read }) : NULL;
+    int ret = -1;
+    if (tee_stream) {
+        TarEntry entry;
+        while ((ret = read_tar_entry(tee_stream, &entry)) == 1) {
+            if (entry.type == '5' && normalize_path(entry.path) == 0 && entry.path[0] != '\0') {
+                list_layer_dir(dirs_list, entry.path);
+            }
+            if (skip_bytes(tee_stream, padded(entry.size)) == -1) {
+                ret = -1;
+                break;
+            }
+        }
+        // tar still gets the end of archive blocks and whatever follows them
+        char buf[TAR_BLOCK_SIZE * 16];
+        while (fread(buf, 1, sizeof(buf), tee_stream) > 0) {
+        }
+        fclose(tee_stream);
+    } else {
+        perror("Error extracting layer");
+    }
+
+    if (tar && pclose(tar) != 0) {
+        fprintf(stderr, "Error extracting %s with tar\n", tarball);
+        ret = -1;
+    }
+    if (stream && pclose(stream) != 0) {
+        fprintf(stderr, "Error decompressing %s\n", tarball);
+        ret = -1;
+    }
+    sigaction(SIGPIPE, &old_action, NULL);
+    return ret == -1 || tee.failed ? -1 : 0;
+}
+
+// tar creates missing parent directories on its own, and leaves existing ones untouched. The merge
+// only sees the staging tree, so the extracting child writes the directories that came with a header
+// to "<staging>.dirs" (NUL separated) for merge_layer() to tell them apart. They are collected in the
+// same pass over the decompressed layer that extracts it.
+static int extract_staged_layer(const char *tarball, const char *staging) {
+    char list_path[PATH_MAX];
+    snprintf(list_path, sizeof(list_path), "%s" LAYER_DIRS_SUFFIX, staging);
+    FILE *dirs_list = fopen(list_path, "w");
+    if (!dirs_list) {
+        perror("Error listing layer directories");
+        return -1;
+    }
+
+    int result;
+    if (extract_backend == EXTRACT_BACKEND_TAR) {
+        result = untar_listing_dirs(tarball, staging, dirs_list);
+    } else {
+        result = extract_layer_native(tarball, staging, dirs_list);
+    }
+    if (fclose(dirs_list) != 0 && result == 0) {
+        fprintf(stderr, "Error listing directories of %s\n", tarball);
+        result = -1;
+    }
+    return result;
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int load_layer_dirs(const char *staging, LayerDirs *dirs) {
+    memset(dirs, 0, sizeof(*dirs));
+    char list_path[PATH_MAX];
+    snprintf(list_path, sizeof(list_path), "%s" LAYER_DIRS_SUFFIX, staging);
+    FILE *list = fopen(list_path, "r");
+    if (!list) {
+        return -1;
+    }
+    fseek(list, 0, SEEK_END);
+    long size = ftell(list);
+    rewind(list);
+
+    dirs->data = malloc(size + 1);
+    if (!dirs->data || fread(dirs->data, 1, size, list) != (size_t)size) {
+        fclose(list);
+        free(dirs->data);
+        return -1;
+    }
+    fclose(list);
+    dirs->data[size] = '\0';
+
+    for (long i = 0; i < size; i++) {
+        if (dirs->data[i] == '\0') dirs->count++;
+    }
+    dirs->paths = calloc(dirs->count + 1, sizeof(char *));
+    if (!dirs->paths) {
+        free(dirs->data);
+        return -1;
+    }
+    size_t n = 0;
+    for (char *p = dirs->data; p < dirs->data + size; p += strlen(p) + 1) {
+        dirs->paths[n++] = p;
+    }
+    qsort(dirs->paths, dirs->count, sizeof(char *), compare_paths);
+    return 0;
+}
+
+static void free_layer_dirs(LayerDirs *dirs) {
+    free(dirs->paths);
+    free(dirs->data);
+}
+
+static bool has_own_header(const MergeContext *ctx) {
+    const char *key = ctx->path;
+    return bsearch(&key, ctx->dirs->paths, ctx->dirs->count, sizeof(char *), compare_paths) != NULL;
+}
+
+// Open the lower directory a symlink at ctx->path leads to, resolved inside the merged tree like
+// tar would when extracting below it. Returns -1 if it doesn't lead to a directory.
+static int open_lower_in_root(const MergeContext *ctx) {
+    struct open_how how = {
+        .flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC,
+        .resolve = RESOLVE_IN_ROOT,
+    };
+    return syscall(SYS_openat2, ctx->root_fd, ctx->path, &how, sizeof(how));
+}
+
+static void copy_dir_metadata(int dir_fd, const char *name, const struct stat *st) {
+    if (geteuid() == 0) {
+        fchownat(dir_fd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+    }
+    fchmodat(dir_fd, name, st->st_mode & 07777, 0);
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    utimensat(dir_fd, name, times, AT_SYMLINK_NOFOLLOW);
+}
+
+static int clear_directory(int dir_fd) {
+    int fd = dup(dir_fd);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    int result = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (remove_tree_at(dir_fd, entry->d_name) == -1) result = -1;
+    }
+    closedir(dir);
+    return result;
+}
+
+// Drop whiteout markers from a directory that was moved over wholesale, there is nothing below it to hide
+static int strip_whiteouts(int dir_fd) {
+    struct stat st;
+    int fd = dup(dir_fd);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir || fstat(dir_fd, &st) == -1) {
+        if (dir) closedir(dir);
+        else if (fd != -1) close(fd);
+        return -1;
+    }
+    int result = 0;
+    bool stripped = false;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (strncmp(entry->d_name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0) {
+            if (unlinkat(dir_fd, entry->d_name, 0) == -1) result = -1;
+            stripped = true;
+            continue;
+        }
+
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (!is_dir) continue;
+
+        int child = openat(dir_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child == -1 || strip_whiteouts(child) == -1) result = -1;
+        if (child != -1) close(child);
+    }
+    closedir(dir);
+
+    // Removing the markers must not show up in the directory's mtime
+    if (stripped) {
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        futimens(dir_fd, times);
+    }
+    return result;
+}
+
+// Apply one extracted layer (upper) on top of the merged lower layers (lower), the way sequential
+// extraction would: entries replace lower ones, ".wh.<name>" deletes <name> and ".wh..wh..opq"
+// hides everything the lower layers had in that directory. A directory only takes the upper
+// metadata if it has its own header, and one that tar would have created below a lower symlink
+// (e.g. lib/x over lib -> usr/lib) is merged into the symlink's target.
+static int merge_layer_dir(MergeContext *ctx, int upper_fd, int lower_fd) {
+    int result = 0;
+
+    if (faccessat(upper_fd, OPAQUE_WHITEOUT, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+        if (clear_directory(lower_fd) == -1) result = -1;
+        unlinkat(upper_fd, OPAQUE_WHITEOUT, 0);
+    }
+
+    int fd = dup(upper_fd);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        if (strncmp(name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0) {
+            const char *hidden = name + strlen(WHITEOUT_PREFIX);
+            if (strcmp(hidden, ".") != 0 && strcmp(hidden, "..") != 0 && hidden[0] != '\0') {
+                if (remove_tree_at(lower_fd, hidden) == -1) result = -1;
+            }
+            unlinkat(upper_fd, name, 0);
+            continue;
+        }
+
+        struct stat upper_st, lower_st;
+        if (fstatat(upper_fd, name, &upper_st, AT_SYMLINK_NOFOLLOW) == -1) {
+            result = -1;
+            continue;
+        }
+        bool lower_exists = fstatat(lower_fd, name, &lower_st, AT_SYMLINK_NOFOLLOW) == 0;
+
+        size_t parent_len = strlen(ctx->path);
+        if (snprintf(ctx->path + parent_len, sizeof(ctx->path) - parent_len, "%s%s",
+                     parent_len ? "/" : "", name) >= (int)(sizeof(ctx->path) - parent_len)) {
+            ctx->path[parent_len] = '\0';
+            result = -1;
+            continue;
+        }
+
+        int lower_child = -1;
+        bool own_header = false;
+        if (S_ISDIR(upper_st.st_mode) && lower_exists) {
+            own_header = has_own_header(ctx);
+            if (S_ISDIR(lower_st.st_mode)) {
+                lower_child = openat(lower_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (lower_child == -1) result = -1;
+            } else if (S_ISLNK(lower_st.st_mode) && !own_header) {
+                lower_child = open_lower_in_root(ctx);
+            }
+        }
+
+        if (lower_child != -1) {
+            // Both layers have the directory: merge entry by entry
+            int upper_child = openat(upper_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (upper_child == -1 || merge_layer_dir(ctx, upper_child, lower_child) == -1) {
+                result = -1;
+            }
+            if (upper_child != -1) close(upper_child);
+            close(lower_child);
+            if (own_header) {
+                copy_dir_metadata(lower_fd, name, &upper_st);
+            }
+            unlinkat(upper_fd, name, AT_REMOVEDIR);
+            ctx->path[parent_len] = '\0';
+            continue;
+        }
+        ctx->path[parent_len] = '\0';
+        if (S_ISDIR(upper_st.st_mode) && lower_exists && S_ISDIR(lower_st.st_mode)) {
+            continue; // --> could not open it, already counted
+        }
+
+        // Anything else replaces the lower entry; a directory can't be renamed over a non-empty one
+        if (lower_exists && (S_ISDIR(lower_st.st_mode) || S_ISDIR(upper_st.st_mode))) {
+            if (remove_tree_at(lower_fd, name) == -1) {
+                result = -1;
+                continue;
+            }
+        }
+        if (renameat(upper_fd, name, lower_fd, name) == -1) {
+            fprintf(stderr, "Error merging %s: %s\n", name, strerror(errno));
+            result = -1;
+            continue;
+        }
+        if (S_ISDIR(upper_st.st_mode)) {
+            int moved = openat(lower_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (moved == -1 || strip_whiteouts(moved) == -1) result = -1;
+            if (moved != -1) close(moved);
+        }
+    }
+    closedir(dir);
+    return result;
+}
+
+static int merge_layer(const char *staging, const char *dest_dir) {
+    MergeContext *ctx = calloc(1, sizeof(MergeContext));
+    LayerDirs dirs;
+    if (!ctx || load_layer_dirs(staging, &dirs) == -1) {
+        perror("Error loading layer directories");
+        free(ctx);
+        return -1;
+    }
+    ctx->dirs = &dirs;
+
+    int upper_fd = open(staging, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int lower_fd = open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ctx->root_fd = lower_fd;
+    int result = -1;
+    if (upper_fd != -1 && lower_fd != -1) {
+        result = merge_layer_dir(ctx, upper_fd, lower_fd);
+    } else {
+        perror("Error opening layer for merge");
+    }
+    if (upper_fd != -1) close(upper_fd);
+    if (lower_fd != -1) close(lower_fd);
+    free_layer_dirs(&dirs);
+    free(ctx);
+    return result;
+}
+
+static void remove_layer_staging(const char *staging) {
+    char list_path[PATH_MAX];
+    snprintf(list_path, sizeof(list_path), "%s" LAYER_DIRS_SUFFIX, staging);
+    unlink(list_path);
+    remove_tree_at(AT_FDCWD, staging);
+}
+
+// Extract all layers of an image into dest_dir. Each layer is extracted into its own staging
+// directory, up to extract_jobs of them at once in child processes, and the staging trees are
+// merged into dest_dir strictly in layer order as soon as each one is ready. Serial
+// (--extract-jobs=1) and parallel runs go through the same merge and produce the same tree.
+int extract_layers(char *const tarballs[], int count, const char *dest_dir) {
+    uint64_t start_ns = metrics_now();
+    int jobs = extract_jobs;
+    if (jobs <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (int)cpus : 1;
+    }
+
+    char (*staging)[PATH_MAX] = calloc(count, PATH_MAX);
+    pid_t *pids = calloc(count, sizeof(pid_t));
+    int *status = calloc(count, sizeof(int));  // 0 pending, 1 extracted, -1 failed
+    if (!staging || !pids || !status) {
+        free(staging); free(pids); free(status);
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        snprintf(staging[i], PATH_MAX, "%s.layer%d_XXXXXX", dest_dir, i);
+        if (!mkdtemp(staging[i])) {
+            perror("Error creating layer staging directory");
+            staging[i][0] = '\0';
+            result = -1;
+        }
+    }
+
+    int next_start = 0, next_merge = 0, running = 0;
+    while (result == 0 && next_merge < count) {
+        // Keep up to jobs extractions going
+        while (next_start < count && running < jobs) {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == -1) {
+                perror("Error forking!");
+                result = -1;
+                break;
+            }
+            if (pid == 0) {
+                _exit(extract_staged_layer(tarballs[next_start], staging[next_start]) == 0 ? 0 : 1);
+            }
+            pids[next_start++] = pid;
+            running++;
+        }
+        if (result == -1) break;
+
+        // Merge every layer that is ready, in order
+        while (next_merge < count && status[next_merge] == 1) {
+            if (merge_layer(staging[next_merge], dest_dir) == -1) {
+                fprintf(stderr, "Error merging layer %d\n", next_merge);
+                result = -1;
+                break;
+            }
+            printf("[+] Layer %d merged.\n", next_merge);
+            next_merge++;
+        }
+        if (result == -1 || next_merge == count) break;
+        if (status[next_merge] == -1) {
+            fprintf(stderr, "Error extracting layer %d\n", next_merge);
+            result = -1;
+            break;
+        }
+
+        int wstatus;
+        pid_t done = waitpid(-1, &wstatus, 0);
+        if (done == -1) {
+            if (errno == EINTR) continue;
+            perror("waitpid");
+            result = -1;
+            break;
+        }
+        for (int i = 0; i < next_start; i++) {
+            if (pids[i] == done) {
+                status[i] = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0 ? 1 : -1;
+                pids[i] = 0;
+                running--;
+            }
+        }
+    }
+
+    // On failure stop the remaining extractions before cleaning up
+    for (int i = 0; i < next_start; i++) {
+        if (pids[i] > 0) {
+            if (result == -1) kill(pids[i], SIGTERM);
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (staging[i][0] != '\0') {
+            remove_layer_staging(staging[i]);
+        }
+    }
+
+    free(staging);
+    free(pids);
+    free(status);
+    if (result == 0) {
+        metrics_observe_extraction(start_ns);
+    }
+    return result;
+}
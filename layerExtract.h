@@ -0,0 +1,15 @@
+#ifndef LAYEREXTRACT_H
+#define LAYEREXTRACT_H
+
+typedef enum ExtractBackend {
+    EXTRACT_BACKEND_TAR,      // external tar (default)
+    EXTRACT_BACKEND_URING,    // in-process, batched through io_uring, thread pool if io_uring is unavailable
+    EXTRACT_BACKEND_THREADS,  // in-process, thread pool only
+} ExtractBackend;
+
+void set_extract_backend(ExtractBackend backend);
+void set_extract_jobs(int jobs);
+int parse_extract_option(const char *arg);
+int extract_layer(const char *tarball, const char *dest_dir);
+int extract_layers(char *const tarballs[], int count, const char *dest_dir);
+#endif
@@ -5,11 +5,20 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <libgen.h>
+#include <fcntl.h>
 #include <sys/mount.h> 
 #include <linux/unistd.h>
 #include <sys/syscall.h>
 #include "networking.h"
+#include "placement.h"
+#include "imageStore.h"
+#include "layerExtract.h"
+#include "rootfsTeardown.h"
+#include "registryMirrors.h"
+#include "metrics.h"
+#include "spawn.h"
 
 //UTILITIES
 void print_current_directory(){
@@ -22,25 +31,6 @@ void print_current_directory(){
    	}
 }
 
-int delete_current_directory() {
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)) == NULL) {
-        perror("getcwd");
-        return -1;
-    }
-    // Change to the parent directory
-    if (chdir("..") == -1) {
-        perror("chdir");
-        return -1;
-    }
-    // Delete the original directory
-    if (rmdir(cwd) == -1) {
-        perror("rmdir");
-        return -1;
-    }
-    return 0;
-}
-
 int copy_image_file(char *source_path, char *destination_path){
 	FILE *source_file, *destination_file;
 	if((source_file = fopen(source_path, "r")) == NULL){
@@ -64,16 +54,33 @@ int copy_image_file(char *source_path, char *destination_path){
 
 //It is preferable for several reasons. The main one is security --> With chroot, processes can potentially escape the chroot jail, especially if they have root privileges. This is because chroot changes only the apparent root directory and does not provide a full filesystem isolation.
 																	//On the other hand, pivot_root is designed to work with namespaces (specifically the mount namespace in Linux) to provide better filesystem isolation.
-int setup_environment(char *docker_image){
-	char template[] = "/tmp/mydir_XXXXXX";
+// Fill dir_name with the image's rootfs, the working directory is left as it was
+int prepare_rootfs(char *docker_image, char *dir_name){
+	int cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-    char* dir_name = mkdtemp(template);
-    if (!dir_name) {
-        perror("Error creating temporary directory");
-        return 1;
-    }
+	// Start from the local store when the image was pulled or prefetched before
+	int res;
+	bool cached = image_store_has(docker_image);
+	metrics_count_store_lookup(cached);
+	if (cached) {
+		res = image_store_checkout(docker_image, dir_name);
+	} else {
+		res = get_image(docker_image, dir_name);
+	}
 
-	int res = get_image(docker_image, dir_name);
+	if (cwd_fd != -1) {
+		if (fchdir(cwd_fd) == -1) {
+			perror("Error changing directory");
+		}
+		close(cwd_fd);
+	}
+	return res;
+}
+
+int setup_environment(char *docker_image, char *dir_name){
+	if (prepare_rootfs(docker_image, dir_name) == -1) {
+		return -1;
+	}
 
 	// chroot to activate our new environment --> its better to use pivot_root (more secure)
   	if (chdir(dir_name) || chroot(dir_name)) {
@@ -83,28 +90,135 @@ int setup_environment(char *docker_image){
 	return 0;
 }
 
-// Usage: ./name_of_program run <image> <command> <arg1> <arg2> ...
+void print_usage(const char *program){
+	fprintf(stderr, "Usage: %s run [--cpus=<list>] [--numa=<node>|auto] [--extract=tar|uring|threads] [--extract-jobs=<n>] [--mirror=<url>] [--spawn=clone3|fork] [--cgroup=<dir>] <image> <command> <arg1> <arg2> ...\n", program);
+	fprintf(stderr, "       %s pull [--dedup] [--extract=tar|uring|threads] [--extract-jobs=<n>] [--mirror=<url>] <image>\n", program);
+	fprintf(stderr, "       %s prefetch [--dedup] [--extract=tar|uring|threads] [--extract-jobs=<n>] [--mirror=<url>] <image-list-file>\n", program);
+	fprintf(stderr, "       %s gc\n", program);
+}
+
+// Usage: ./name_of_program run [options] <image> <command> <arg1> <arg2> ...
 int main(int argc, char *argv[]) {
     // Disable output buffering
     setbuf(stdout, NULL);
+    metrics_init();
+
+    if (argc >= 3 && (strcmp(argv[1], "pull") == 0 || strcmp(argv[1], "prefetch") == 0)) {
+        int arg_index = 2;
+        while (arg_index < argc && strncmp(argv[arg_index], "--", 2) == 0) {
+            if (strcmp(argv[arg_index], "--dedup") == 0) {
+                image_store_set_dedup(true);
+            } else if (parse_extract_option(argv[arg_index]) != 1 && parse_mirror_option(argv[arg_index]) != 1) {
+                print_usage(argv[0]);
+                return -1;
+            }
+            arg_index++;
+        }
+        if (argc - arg_index != 1) {
+            print_usage(argv[0]);
+            return -1;
+        }
+        if (strcmp(argv[1], "pull") == 0) {
+            int pulled = image_store_pull(argv[arg_index]);
+            write_metrics();
+            return pulled;
+        }
+        return image_store_prefetch(argv[arg_index]);
+    }
+    if (argc == 2 && strcmp(argv[1], "gc") == 0) {
+        return image_store_gc();
+    }
+
+    if (argc < 2 || strcmp(argv[1], "run") != 0) {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    Placement placement;
+    init_placement(&placement);
+
+    int arg_index = 2;
+    while (arg_index < argc && strncmp(argv[arg_index], "--", 2) == 0) {
+        int parsed = parse_placement_option(argv[arg_index], &placement);
+        if (parsed == 0) {
+            parsed = parse_extract_option(argv[arg_index]);
+        }
+        if (parsed == 0) {
+            parsed = parse_mirror_option(argv[arg_index]);
+        }
+        if (parsed == 0) {
+            parsed = parse_spawn_option(argv[arg_index]);
+        }
+        if (parsed != 1) {
+            print_usage(argv[0]);
+            return -1;
+        }
+        arg_index++;
+    }
+
+    if (argc - arg_index < 2) {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    char *docker_image = argv[arg_index];
+    char **command_argv = &argv[arg_index + 1];
+    char *command = command_argv[0];
+
+    if (resolve_placement(&placement) == -1) {
+        return -1;
+    }
+
+    // Clear out what crashed runs left behind, then claim our own root directory
+    sweep_stale_rootfs();
+    char template[PATH_MAX];
+    snprintf(template, sizeof(template), "%s/" ROOTFS_PREFIX "XXXXXX", rootfs_parent_dir());
+    int rootfs_lock;
+    char *dir_name = create_rootfs_dir(template, &rootfs_lock);
+    if (!dir_name) {
+        perror("Error creating temporary directory");
+        release_placement(&placement);
+        return -1;
+    }
 
     int pipe_stdout[2];
     int pipe_stderr[2];
     
-    if(pipe(pipe_stdout) == -1 || pipe(pipe_stderr) == -1){
+    // The reaper is forked now, it can't be forked into the PID namespace once the container is gone
+    int reaper_fd = spawn_reaper();
+
+    if(pipe2(pipe_stdout, O_CLOEXEC) == -1 || pipe2(pipe_stderr, O_CLOEXEC) == -1){
         perror("error creating pipes!");
+        discard_rootfs(dir_name);
+        trigger_reaper(reaper_fd);
+        release_placement(&placement);
         return -1;
     }
-    
-    char *command = argv[3];
-    char *docker_image = argv[2];
 
-    unshare(CLONE_NEWPID); 
+    int pid;
+    int pidfd = -1;
+    if (spawn_mode() == SPAWN_CLONE3) {
+        // The launcher takes the placement and prepares the rootfs itself, the child inherits the
+        // placement and only has to chroot and exec
+        if (apply_placement(&placement) == -1 || prepare_rootfs(docker_image, dir_name) == -1) {
+            discard_rootfs(dir_name);
+            trigger_reaper(reaper_fd);
+            release_placement(&placement);
+            return -1;
+        }
+        pid = spawn_container(dir_name, command_argv, pipe_stdout[1], pipe_stderr[1], &pidfd);
+    } else {
+        unshare(CLONE_NEWPID); 
 
-    int pid = fork();
+        metrics_mark_spawn(SPAWN_FORK);
+        pid = fork();
+    }
 
     if (pid == -1) {
         perror("Error forking!");
+        discard_rootfs(dir_name);
+        trigger_reaper(reaper_fd);
+        release_placement(&placement);
         return -1;
     }
     
@@ -115,9 +229,16 @@ int main(int argc, char *argv[]) {
         dup2(pipe_stdout[1], STDOUT_FILENO);
         dup2(pipe_stderr[1], STDERR_FILENO);
 
-        setup_environment(docker_image);
+        if (apply_placement(&placement) == -1) {
+            _exit(-1);
+        }
 
-        int res_exec = execv(command, &argv[3]);
+        if (setup_environment(docker_image, dir_name) == -1) {
+            _exit(-1);
+        }
+
+        metrics_observe_exec();
+        int res_exec = execv(command, command_argv);
         if(res_exec == -1){
             perror("\nexec error");
             _exit(-1);
@@ -159,9 +280,20 @@ int main(int argc, char *argv[]) {
         }
 
         int status;
-        wait(&status);
+        if (wait_container(pid, pidfd, &status) == -1) {
+            perror("Error waiting for the container");
+            status = W_EXITCODE(255, 0);
+        }
+        metrics_count_container_exit(status);
         close(pipe_stdout[0]);
         close(pipe_stderr[0]);
+        release_placement(&placement);
+
+        // Hand the rootfs to the background reaper, exit does not wait for the deletion
+        discard_rootfs(dir_name);
+        close(rootfs_lock);
+        trigger_reaper(reaper_fd);
+        write_metrics();
 
         if (WIFEXITED(status)) {
             return WEXITSTATUS(status);
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE // --> for MAP_ANONYMOUS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "metrics.h"
+#include "spawn.h"
+#include "systemUtils.h"
+
+// Counters and histograms for pulls, the image store and container lifecycle. They live in a
+// shared anonymous mapping so the container child and the layer extraction children (forked after
+// metrics_init()) record into the launcher's copy. Recording is a relaxed atomic add, no syscall.
+// write_metrics() adds the run's values to the totals kept next to the output file and rewrites it
+// in the Prometheus text format for node_exporter's textfile collector.
+
+#define METRICS_FILE_ENV "LDENV_METRICS_FILE"
+#define METRICS_STATE_SUFFIX ".state"
+#define METRICS_STATE_MAGIC "LDENVMET"
+#define METRICS_STATE_VERSION 1   // bump whenever struct Metrics changes
+#define HTTP_STATUS_SLOTS 600
+#define EXIT_CODE_SLOTS 257    // exit codes 0-255, then killed by a signal
+#define MAX_BUCKETS 16
+#define NSEC_PER_SEC 1000000000ULL
+#define MIB (1024ULL * 1024)
+
+#define METRIC_ADD(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+
+typedef struct Histogram {
+    uint64_t buckets[MAX_BUCKETS + 1];  // per bucket (not cumulative), the last one is +Inf
+    uint64_t count;
+    uint64_t sum;                       // in raw units (bytes or nanoseconds)
+} Histogram;
+
+typedef struct HistogramSpec {
+    const char *name;
+    const char *help;
+    double scale;                      // raw units per exported unit
+    uint64_t bounds[MAX_BUCKETS];      // upper bounds in raw units, 0 terminated
+} HistogramSpec;
+
+// Only uint64_t fields: totals are kept by adding the structs field by field
+typedef struct Metrics {
+    uint64_t downloaded_bytes;
+    uint64_t http_responses[HTTP_STATUS_SLOTS];
+    uint64_t http_redirects;
+    uint64_t token_fetches[2];      // failure, success
+    uint64_t failovers;
+    uint64_t store_lookups[2];      // miss, hit
+    uint64_t pulls[2];              // failure, success
+    uint64_t container_exits[EXIT_CODE_SLOTS];
+    Histogram layer_bytes;
+    Histogram extraction;
+    Histogram time_to_exec;
+    Histogram spawn_to_exec[SPAWN_MODES];
+} Metrics;
+
+// Written in front of the totals, a state file from a build with another layout is not added to
+typedef struct MetricsStateHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+} MetricsStateHeader;
+
+static const HistogramSpec layer_bytes_spec = {
+    "ldenv_layer_download_bytes", "Size of each downloaded layer blob.", 1,
+    { 64 * 1024, 256 * 1024, MIB, 4 * MIB, 16 * MIB, 64 * MIB, 256 * MIB, 1024 * MIB }
+};
+static const HistogramSpec extraction_spec = {
+    "ldenv_extraction_duration_seconds", "Time to extract and merge all layers of an image.", NSEC_PER_SEC,
+    { NSEC_PER_SEC / 10, NSEC_PER_SEC / 4, NSEC_PER_SEC / 2, NSEC_PER_SEC, 5 * NSEC_PER_SEC / 2, 5 * NSEC_PER_SEC,
+      10 * NSEC_PER_SEC, 30 * NSEC_PER_SEC, 60 * NSEC_PER_SEC, 120 * NSEC_PER_SEC }
+};
+static const HistogramSpec time_to_exec_spec = {
+    "ldenv_time_to_exec_seconds", "Time from the launcher's start to the container's execv().", NSEC_PER_SEC,
+    { NSEC_PER_SEC / 200, NSEC_PER_SEC / 100, NSEC_PER_SEC / 40, NSEC_PER_SEC / 20, NSEC_PER_SEC / 10,
+      NSEC_PER_SEC / 4, NSEC_PER_SEC / 2, NSEC_PER_SEC, 5 * NSEC_PER_SEC / 2, 5 * NSEC_PER_SEC, 10 * NSEC_PER_SEC,
+      30 * NSEC_PER_SEC, 60 * NSEC_PER_SEC, 120 * NSEC_PER_SEC }
+};
+
+static const HistogramSpec spawn_to_exec_spec = {
+    "ldenv_spawn_to_exec_seconds", "Time from the fork or clone of the container process to its execv(). The fork path includes the image fetch or checkout, clone3 does not.", NSEC_PER_SEC,
+    { NSEC_PER_SEC / 10000, NSEC_PER_SEC / 4000, NSEC_PER_SEC / 2000, NSEC_PER_SEC / 1000, NSEC_PER_SEC / 400,
+      NSEC_PER_SEC / 200, NSEC_PER_SEC / 100, NSEC_PER_SEC / 40, NSEC_PER_SEC / 20, NSEC_PER_SEC / 10,
+      NSEC_PER_SEC / 4, NSEC_PER_SEC / 2, NSEC_PER_SEC, 5 * NSEC_PER_SEC / 2, 5 * NSEC_PER_SEC, 10 * NSEC_PER_SEC }
+};
+static const char *const spawn_paths[SPAWN_MODES] = { "clone3", "fork" };
+
+static Metrics local_metrics;
+static Metrics *metrics = &local_metrics;  // --> until metrics_init() maps the shared copy
+static uint64_t launch_ns;
+static uint64_t spawn_ns;    // --> copied into the child with the rest of the launcher's memory
+static int spawn_path = -1;
+
+uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+// Call once at startup, before anything that should be counted forks
+void metrics_init() {
+    launch_ns = metrics_now();
+    Metrics *shared = mmap(NULL, sizeof(Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        return; // --> children's updates are lost, the launcher's own are still counted
+    }
+    metrics = shared;
+}
+
+static void observe(Histogram *histogram, const HistogramSpec *spec, uint64_t value) {
+    int bucket = 0;
+    while (bucket < MAX_BUCKETS && spec->bounds[bucket] && value > spec->bounds[bucket]) {
+        bucket++;
+    }
+    if (bucket < MAX_BUCKETS && !spec->bounds[bucket]) {
+        bucket = MAX_BUCKETS;
+    }
+    METRIC_ADD(histogram->buckets[bucket], 1);
+    METRIC_ADD(histogram->count, 1);
+    METRIC_ADD(histogram->sum, value);
+}
+
+void metrics_count_http_response(long status_code) {
+    if (status_code > 0 && status_code < HTTP_STATUS_SLOTS) {
+        METRIC_ADD(metrics->http_responses[status_code], 1);
+    }
+}
+
+void metrics_count_redirects(long redirects) {
+    if (redirects > 0) {
+        METRIC_ADD(metrics->http_redirects, (uint64_t)redirects);
+    }
+}
+
+void metrics_count_token_fetch(bool ok) {
+    METRIC_ADD(metrics->token_fetches[ok], 1);
+}
+
+void metrics_count_failover() {
+    METRIC_ADD(metrics->failovers, 1);
+}
+
+// Every successful registry response adds to the byte count, layer blobs also go to the size histogram
+void metrics_count_download(uint64_t bytes, bool layer) {
+    METRIC_ADD(metrics->downloaded_bytes, bytes);
+    if (layer) {
+        observe(&metrics->layer_bytes, &layer_bytes_spec, bytes);
+    }
+}
+
+void metrics_count_store_lookup(bool hit) {
+    METRIC_ADD(metrics->store_lookups[hit], 1);
+}
+
+void metrics_count_pull(bool ok) {
+    METRIC_ADD(metrics->pulls[ok], 1);
+}
+
+void metrics_count_container_exit(int wait_status) {
+    if (WIFEXITED(wait_status)) {
+        METRIC_ADD(metrics->container_exits[WEXITSTATUS(wait_status)], 1);
+    } else if (WIFSIGNALED(wait_status)) {
+        METRIC_ADD(metrics->container_exits[EXIT_CODE_SLOTS - 1], 1);
+    }
+}
+
+void metrics_observe_extraction(uint64_t start_ns) {
+    observe(&metrics->extraction, &extraction_spec, metrics_now() - start_ns);
+}
+
+// Called by the launcher right before it forks or clones the container
+void metrics_mark_spawn(int path) {
+    spawn_path = path;
+    spawn_ns = metrics_now();
+}
+
+// Called when the container execs: by the child right before execv() on the fork path, by the launcher
+// once the vfork is released on the clone3 path
+void metrics_observe_exec() {
+    uint64_t now = metrics_now();
+    observe(&metrics->time_to_exec, &time_to_exec_spec, now - launch_ns);
+    if (spawn_path >= 0 && spawn_path < SPAWN_MODES) {
+        observe(&metrics->spawn_to_exec[spawn_path], &spawn_to_exec_spec, now - spawn_ns);
+    }
+}
+
+//OUTPUT
+
+static void write_header(FILE *fp, const char *name, const char *help, const char *type) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void write_counter(FILE *fp, const char *name, const char *help, uint64_t value) {
+    write_header(fp, name, help, "counter");
+    fprintf(fp, "%s %llu\n", name, (unsigned long long)value);
+}
+
+static void write_result_counter(FILE *fp, const char *name, const char *help, const uint64_t values[2]) {
+    write_header(fp, name, help, "counter");
+    fprintf(fp, "%s{result=\"success\"} %llu\n", name, (unsigned long long)values[1]);
+    fprintf(fp, "%s{result=\"failure\"} %llu\n", name, (unsigned long long)values[0]);
+}
+
+// labels is empty or a list like 'path="fork"'
+static void write_histogram_series(FILE *fp, const HistogramSpec *spec, const char *labels, const Histogram *histogram) {
+    const char *separator = *labels ? "," : "";
+    uint64_t cumulative = 0;
+    for (int i = 0; i < MAX_BUCKETS && spec->bounds[i]; i++) {
+        cumulative += histogram->buckets[i];
+        fprintf(fp, "%s_bucket{%s%sle=\"%.10g\"} %llu\n", spec->name, labels, separator, spec->bounds[i] / spec->scale,
+                (unsigned long long)cumulative);
+    }
+    fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", spec->name, labels, separator, (unsigned long long)histogram->count);
+    if (*labels) {
+        fprintf(fp, "%s_sum{%s} %.15g\n", spec->name, labels, histogram->sum / spec->scale);
+        fprintf(fp, "%s_count{%s} %llu\n", spec->name, labels, (unsigned long long)histogram->count);
+    } else {
+        fprintf(fp, "%s_sum %.15g\n", spec->name, histogram->sum / spec->scale);
+        fprintf(fp, "%s_count %llu\n", spec->name, (unsigned long long)histogram->count);
+    }
+}
+
+static void write_histogram(FILE *fp, const HistogramSpec *spec, const Histogram *histogram) {
+    write_header(fp, spec->name, spec->help, "histogram");
+    write_histogram_series(fp, spec, "", histogram);
+}
+
+static void write_prometheus(FILE *fp, const Metrics *totals) {
+    write_counter(fp, "ldenv_downloaded_bytes_total", "Bytes received from registries in successful responses.", totals->downloaded_bytes);
+
+    write_header(fp, "ldenv_http_responses_total", "Registry and auth HTTP responses by status code.", "counter");
+    for (int code = 0; code < HTTP_STATUS_SLOTS; code++) {
+        if (totals->http_responses[code]) {
+            fprintf(fp, "ldenv_http_responses_total{code=\"%d\"} %llu\n", code, (unsigned long long)totals->http_responses[code]);
+        }
+    }
+
+    write_counter(fp, "ldenv_http_redirects_total", "HTTP redirects followed or reported by registries.", totals->http_redirects);
+    write_result_counter(fp, "ldenv_token_fetches_total", "Registry authentication token requests.", totals->token_fetches);
+    write_counter(fp, "ldenv_registry_failovers_total", "Requests moved to another registry mirror.", totals->failovers);
+
+    write_header(fp, "ldenv_image_store_lookups_total", "Container starts served from the local image store.", "counter");
+    fprintf(fp, "ldenv_image_store_lookups_total{result=\"hit\"} %llu\n", (unsigned long long)totals->store_lookups[1]);
+    fprintf(fp, "ldenv_image_store_lookups_total{result=\"miss\"} %llu\n", (unsigned long long)totals->store_lookups[0]);
+
+    write_result_counter(fp, "ldenv_image_pulls_total", "Images pulled into the local image store.", totals->pulls);
+
+    write_header(fp, "ldenv_container_exits_total", "Finished containers by exit code.", "counter");
+    for (int code = 0; code < EXIT_CODE_SLOTS; code++) {
+        if (!totals->container_exits[code]) continue;
+        if (code == EXIT_CODE_SLOTS - 1) {
+            fprintf(fp, "ldenv_container_exits_total{code=\"signal\"} %llu\n", (unsigned long long)totals->container_exits[code]);
+        } else {
+            fprintf(fp, "ldenv_container_exits_total{code=\"%d\"} %llu\n", code, (unsigned long long)totals->container_exits[code]);
+        }
+    }
+
+    write_histogram(fp, &layer_bytes_spec, &totals->layer_bytes);
+    write_histogram(fp, &extraction_spec, &totals->extraction);
+    write_histogram(fp, &time_to_exec_spec, &totals->time_to_exec);
+
+    write_header(fp, spawn_to_exec_spec.name, spawn_to_exec_spec.help, "histogram");
+    for (int path = 0; path < SPAWN_MODES; path++) {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "path=\"%s\"", spawn_paths[path]);
+        write_histogram_series(fp, &spawn_to_exec_spec, labels, &totals->spawn_to_exec[path]);
+    }
+}
+
+// Add this process's metrics to the stored totals and rewrite the textfile (atomically, the collector
+// may read it at any time). LDENV_METRICS_FILE picks the file, an empty value turns the export off.
+int write_metrics() {
+    const char *path = getenv(METRICS_FILE_ENV);
+    if (!path) {
+        path = METRICS_FILE;
+    }
+    if (!*path) {
+        return 0;
+    }
+
+    if (strcmp(path, METRICS_FILE) == 0 && ensure_private_dir(METRICS_DIR) == -1) {
+        return -1;
+    }
+
+    char state_path[1024];
+    char tmp_path[1024];
+    snprintf(state_path, sizeof(state_path), "%s" METRICS_STATE_SUFFIX, path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+
+    int state_fd = open(state_path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (state_fd == -1 || flock(state_fd, LOCK_EX) == -1) {
+        perror("Error opening metrics state");
+        if (state_fd != -1) close(state_fd);
+        return -1;
+    }
+
+    // A state file from a build with a different layout starts the totals over
+    MetricsStateHeader header;
+    static Metrics totals;
+    bool compatible = pread(state_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                      memcmp(header.magic, METRICS_STATE_MAGIC, sizeof(header.magic)) == 0 &&
+                      header.version == METRICS_STATE_VERSION && header.size == sizeof(Metrics) &&
+                      pread(state_fd, &totals, sizeof(totals), sizeof(header)) == (ssize_t)sizeof(totals);
+    if (!compatible) {
+        memset(&totals, 0, sizeof(totals));
+    }
+    uint64_t *total_fields = (uint64_t *)&totals;
+    uint64_t *run_fields = (uint64_t *)metrics;
+    for (size_t i = 0; i < sizeof(Metrics) / sizeof(uint64_t); i++) {
+        total_fields[i] += __atomic_exchange_n(&run_fields[i], 0, __ATOMIC_RELAXED);
+    }
+
+    memcpy(header.magic, METRICS_STATE_MAGIC, sizeof(header.magic));
+    header.version = METRICS_STATE_VERSION;
+    header.size = sizeof(Metrics);
+    int result = 0;
+    if (pwrite(state_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        pwrite(state_fd, &totals, sizeof(totals), sizeof(header)) != (ssize_t)sizeof(totals) ||
+        ftruncate(state_fd, sizeof(header) + sizeof(totals)) == -1) {
+        perror("Error writing metrics state");
+        result = -1;
+    }
+
+    int tmp_fd = mkstemp(tmp_path);
+    FILE *fp = tmp_fd == -1 ? NULL : fdopen(tmp_fd, "w");
+    if (!fp) {
+        perror("Error writing metrics");
+        if (tmp_fd != -1) {
+            close(tmp_fd);
+            unlink(tmp_path);
+        }
+        close(state_fd);
+        return -1;
+    }
+    write_prometheus(fp, &totals);
+    fchmod(tmp_fd, 0644);
+    if (fclose(fp) != 0 || rename(tmp_path, path) == -1) {
+        perror("Error writing metrics");
+        unlink(tmp_path);
+        result = -1;
+    }
+
+    close(state_fd); // --> releases the lock
+    return result;
+}
@@ -0,0 +1,24 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define METRICS_DIR "/run/ldenv"
+#define METRICS_FILE METRICS_DIR "/metrics.prom"   // overridden by the LDENV_METRICS_FILE environment variable
+
+void metrics_init();
+uint64_t metrics_now();
+void metrics_count_http_response(long status_code);
+void metrics_count_redirects(long redirects);
+void metrics_count_token_fetch(bool ok);
+void metrics_count_failover();
+void metrics_count_download(uint64_t bytes, bool layer);
+void metrics_count_store_lookup(bool hit);
+void metrics_count_pull(bool ok);
+void metrics_count_container_exit(int wait_status);
+void metrics_observe_extraction(uint64_t start_ns);
+void metrics_mark_spawn(int path);
+void metrics_observe_exec();
+int write_metrics();
+#endif
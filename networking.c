@@ -6,36 +6,32 @@
 #include "networking.h"
 #include "listsUtils.h"
 #include "parseManifest.h"
+#include "layerExtract.h"
+#include "registryMirrors.h"
+#include "metrics.h"
 
-#define AUTH_PREFIX "Authorization: Bearer "
 #define MAX_FILENAME_SIZE 256
 #define DIGEST_PREFIX "\"digest\":\""
 #define ARCHITECTURE_PREFIX "\"architecture\":\""
 #define TOKEN_PREFIX "\"token\":"
-#define AUTH_URL "https://auth.docker.io/token?service=registry.docker.io&scope=repository:"
 #define ACTION ":pull"
-#define ACCEPT_HEADER "Accept: application/vnd.docker.distribution.manifest.v2+json, application/vnd.oci.image.manifest.v1+json"
-
-typedef struct {
-    char *data;       // Pointer to our dynamic buffer
-    size_t size;     // Current size of the buffer
-} ResponseBuffer;
 
 void initialize_curl_global() {
     curl_global_init(CURL_GLOBAL_DEFAULT);
 }
 
 void cleanup_curl_global() {
+    release_mirrors();
     curl_global_cleanup();
 }
 
-FILE *open_unique_file(const char *basename, const char *ext) {
-    char filename[MAX_FILENAME_SIZE];
+// Open <basename>_<N><ext> for the first free N, its name is stored in filename
+FILE *open_unique_file(const char *basename, const char *ext, char *filename, size_t size) {
     int counter = 0;
     FILE *fp = NULL;
 
     do {
-        snprintf(filename, sizeof(filename), "%s_%d%s", basename, counter, ext);
+        snprintf(filename, size, "%s_%d%s", basename, counter, ext);
         fp = fopen(filename, "r");
         if (fp != NULL) {
             fclose(fp);
@@ -67,7 +63,8 @@ void download_file(const char *url, const char *filename, const char *token) {
         headers = curl_slist_append(headers, auth_header);
     }
 
-    FILE *fp = open_unique_file(filename, ".tar");
+    char unique_filename[MAX_FILENAME_SIZE];
+    FILE *fp = open_unique_file(filename, ".tar", unique_filename, sizeof(unique_filename));
     if (!fp) {
         perror("Failed to open file for writing");
         curl_easy_cleanup(curl);
@@ -86,6 +83,7 @@ void download_file(const char *url, const char *filename, const char *token) {
     } else {
         long http_response_code;
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_response_code);
+        metrics_count_http_response(http_response_code);
         if (http_response_code == 200) {
             printf("[+] File downloaded successfully.\n");
         } else {
@@ -141,8 +139,9 @@ char * parse_token(char * raw_token) {
   return token;
 }
 
-char *get_auth_token(const char *image_name) {
-    size_t auth_url_len = strlen(AUTH_URL) + strlen(image_name) + strlen(ACTION) + 1;
+// auth_url is the token endpoint up to the repository name (see DEFAULT_AUTH_URL)
+char *get_auth_token(const char *auth_url, const char *image_name) {
+    size_t auth_url_len = strlen(auth_url) + strlen(image_name) + strlen(ACTION) + 1;
     char *final_auth_url = (char *)malloc(auth_url_len);
 
     if (!final_auth_url) {
@@ -150,9 +149,10 @@ char *get_auth_token(const char *image_name) {
         return NULL;
     }
 
-    snprintf(final_auth_url, auth_url_len, "%s%s%s", AUTH_URL, image_name, ACTION);
+    snprintf(final_auth_url, auth_url_len, "%s%s%s", auth_url, image_name, ACTION);
     char *content = get_response(final_auth_url, NULL, "token");
     free(final_auth_url);
+    metrics_count_token_fetch(content != NULL);
 
     if (!content) {
         fprintf(stderr, "Failed to obtain authentication token\n");
@@ -236,6 +236,7 @@ char *get_response(const char *url, const char *token, const char *purpose) {
     } else {
         long http_response_code;
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_response_code);
+        metrics_count_http_response(http_response_code);
 
         switch(http_response_code) {
             case 200:
@@ -251,6 +252,7 @@ char *get_response(const char *url, const char *token, const char *purpose) {
                 break;
             case 307:
                 printf("Redirection required.\n");
+                metrics_count_redirects(1);
                 char *location = NULL;
                 curl_easy_getinfo(curl, CURLINFO_REDIRECT_URL, &location);
                 if (location) {
@@ -276,14 +278,13 @@ char *get_response(const char *url, const char *token, const char *purpose) {
     return buffer.data;
 }
 
-char *get_manifest(const char *image_name, const char *token) {
-    const char *registry_url = "https://registry.hub.docker.com";
+// The manifest comes from whichever registry mirror answers best, see registryMirrors.c
+char *get_manifest(const char *image_name) {
     const char *image_reference = "latest";
-    char manifest_url[1024];
+    char manifest_path[1024];
 
-    // Build the manifest URL
-    snprintf(manifest_url, sizeof(manifest_url), "%s/v2/%s/manifests/%s", registry_url, image_name, image_reference);
-    char *content = get_response(manifest_url, token, "image manifest");
+    snprintf(manifest_path, sizeof(manifest_path), "manifests/%s", image_reference);
+    char *content = registry_get(image_name, manifest_path, "image manifest");
     if (!content) {
         fprintf(stderr, "Failed to retrieve content\n");
         return NULL;
@@ -303,9 +304,9 @@ char *get_manifest(const char *image_name, const char *token) {
         }
 
         if (current) {
-            char specific_manifest_url[1024];
-            snprintf(specific_manifest_url, sizeof(specific_manifest_url), "%s/v2/%s/manifests/%s", registry_url, image_name, current->digest);
-            manifest = get_response(specific_manifest_url, token, "image manifest");
+            char specific_manifest_path[1024];
+            snprintf(specific_manifest_path, sizeof(specific_manifest_path), "manifests/%s", current->digest);
+            manifest = registry_get(image_name, specific_manifest_path, "image manifest");
         } else {
             fprintf(stderr, "Error: Index %d is out of bounds\n", specificIndex);
         }
@@ -334,6 +335,25 @@ int move_file_to_directory(const char *filename, const char *dir_name) {
     return 0;
 }
 
+// Download one layer blob into the current directory (as downloaded_file_N.tar), checked against its digest
+int fetch_layer(const char *image_name, const char *digest) {
+    char filename[MAX_FILENAME_SIZE];
+    FILE *fp = open_unique_file("downloaded_file", ".tar", filename, sizeof(filename));
+    if (!fp) {
+        perror("Failed to open file for writing");
+        return -1;
+    }
+
+    char layer_path[1024];
+    snprintf(layer_path, sizeof(layer_path), "blobs/%s", digest);
+    int result = registry_download(image_name, layer_path, fp, digest);
+    fclose(fp);
+    if (result == -1) {
+        remove(filename);
+    }
+    return result;
+}
+
 int get_image(char *image_name, char *dir_name) {
     // Initialization
     initialize_curl_global();
@@ -349,19 +369,9 @@ int get_image(char *image_name, char *dir_name) {
     printf("      Docker Image Fetch Utility\n");
     printf("============================================\n\n");
 
-    // Get authentication token
-    printf("[*] Fetching authentication token...\n");
-    char *token = get_auth_token(image_name);
-    if (!token) {
-        fprintf(stderr, "Error retrieving authentication token.\n");
-        cleanup_curl_global();
-        return -1;
-    }
-
-    // Retrieve image manifest
-    printf("\n[*] Retrieving image manifest for: %s...\n", image_name);
-    char *manifest = get_manifest(image_name, token);
-    free(token);
+    // Retrieve image manifest, tokens are fetched per registry mirror as needed
+    printf("[*] Retrieving image manifest for: %s...\n", image_name);
+    char *manifest = get_manifest(image_name);
     if (!manifest) {
         fprintf(stderr, "Error retrieving image manifest.\n");
         cleanup_curl_global();
@@ -391,41 +401,47 @@ int get_image(char *image_name, char *dir_name) {
 
     // Fetch and process each layer
     int i = 0;
-    while (manifest_info->layersList != NULL) {
+    Layer *layer = manifest_info->layersList;
+    while (layer != NULL) {
         printf("[*] Fetching layer %d\n", i);
         printf("--------------------------------------------------------\n");
         ++i;
 
-        token = get_auth_token(image_name);
-        if (!token) {
-            fprintf(stderr, "Error retrieving authentication token for layer %d.\n", i);
-            clean_resources(manifest, manifest_info);
-            return -1;
-        }
-
-        char layer_url[1024];
-        snprintf(layer_url, sizeof(layer_url), "https://registry.hub.docker.com/v2/%s/blobs/%s", image_name, manifest_info->layersList->digest);
-        char *response = get_response(layer_url, token, "Layer");
-        free(token);
-        if (!response) {
-            fprintf(stderr, "Error retrieving response for layer %d.\n", i);
+        if (fetch_layer(image_name, layer->digest) == -1) {
+            fprintf(stderr, "Error retrieving layer %d.\n", i);
             clean_resources(manifest, manifest_info);
             return -1;
         }
-        free(response);
 
-        manifest_info->layersList = manifest_info->layersList->next;
+        layer = layer->next;
     }
 
     // Extract downloaded files
     printf("[+] All Files downloaded successfully.\n");
+    char (*filenames)[256] = calloc(i > 0 ? i : 1, sizeof(*filenames));
+    char **tarballs = calloc(i > 0 ? i : 1, sizeof(char *));
+    if (!filenames || !tarballs) {
+        free(filenames);
+        free(tarballs);
+        clean_resources(manifest, manifest_info);
+        return -1;
+    }
     for (int j = 0; j < i; j++) {
-        char filename[256];
-        snprintf(filename, sizeof(filename), "downloaded_file_%d.tar", j);
-        printf("--------------------------------------------------------\n");
-        printf("[*] Extracting %s.\n", filename);
-        untar_and_remove(filename);
-        printf("[+] %s Extracted successfully.\n", filename);
+        snprintf(filenames[j], sizeof(filenames[j]), "downloaded_file_%d.tar", j);
+        tarballs[j] = filenames[j];
+    }
+    printf("--------------------------------------------------------\n");
+    printf("[*] Extracting %d layers.\n", i);
+    int extracted = extract_layers(tarballs, i, dir_name);
+    for (int j = 0; j < i; j++) {
+        remove(filenames[j]);
+    }
+    free(filenames);
+    free(tarballs);
+    if (extracted == -1) {
+        fprintf(stderr, "Error extracting layers.\n");
+        clean_resources(manifest, manifest_info);
+        return -1;
     }
 
     printf("\n\n[+] All Files extracted successfully");
@@ -456,8 +472,27 @@ int untar_and_remove(const char * filename) {
   return 0; // Return 0 on success
 }
 
+int untar_to_directory(const char *filename, const char *dir_name) {
+  char command[1024];
+
+  // Extract the archive into dir_name, keeping the archive
+  snprintf(command, sizeof(command), "tar -xf '%s' -C '%s'", filename, dir_name);
+
+  int result = system(command);
+
+  if (result == -1) {
+    perror("Failed to execute command");
+    return -1;
+  }
+
+  return result == 0 ? 0 : -1;
+}
+
 void clean_resources(char *manifest, Manifest_parsed_info *manifest_info) {
     if (manifest) free(manifest);
-    if (manifest_info) free(manifest_info);
+    if (manifest_info) {
+        freeLayerList(manifest_info->layersList);
+        free(manifest_info);
+    }
     cleanup_curl_global();
 }
\ No newline at end of file
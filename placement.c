@@ -0,0 +1,315 @@
+#define _GNU_SOURCE // --> for sched_setaffinity() and the CPU_SET macros
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "placement.h"
+#include "systemUtils.h"
+
+#define NODE_SYSFS_DIR "/sys/devices/system/node"
+#define CPUS_OPTION "--cpus="
+#define NUMA_OPTION "--numa="
+#define MAX_PLACEMENT_ENTRIES 4096
+
+void init_placement(Placement *placement) {
+    placement->cpus[0] = '\0';
+    placement->node = -1;
+    placement->automatic = false;
+}
+
+// Parse a kernel style list ("0-3,8,10-11") into a set of ids, returns the number of ids or -1
+static int parse_id_list(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    int count = 0;
+    const char *p = list;
+
+    while (*p && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long id = first; id <= last; id++) {
+            CPU_SET(id, set);
+            count++;
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p && *p != '\n') {
+            return -1;
+        }
+    }
+    return count;
+}
+
+static int read_sysfs_list(const char *path, cpu_set_t *set) {
+    char buf[1024];
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    if (!fgets(buf, sizeof(buf), fp)) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return parse_id_list(buf, set);
+}
+
+static int read_node_cpus(int node, cpu_set_t *set) {
+    char path[256];
+    snprintf(path, sizeof(path), NODE_SYSFS_DIR "/node%d/cpulist", node);
+    return read_sysfs_list(path, set);
+}
+
+static long read_node_free_kb(int node) {
+    char path[256];
+    char line[256];
+    long free_kb = 0;
+    snprintf(path, sizeof(path), NODE_SYSFS_DIR "/node%d/meminfo", node);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char *field = strstr(line, "MemFree:");
+        if (field) {
+            free_kb = strtol(field + strlen("MemFree:"), NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return free_kb;
+}
+
+// Returns 1 if the argument was a placement option, 0 if not, -1 if it was malformed
+int parse_placement_option(const char *arg, Placement *placement) {
+    if (strncmp(arg, CPUS_OPTION, strlen(CPUS_OPTION)) == 0) {
+        const char *list = arg + strlen(CPUS_OPTION);
+        cpu_set_t set;
+        if (strlen(list) >= sizeof(placement->cpus) || parse_id_list(list, &set) <= 0) {
+            fprintf(stderr, "Invalid CPU list: %s\n", list);
+            return -1;
+        }
+        strcpy(placement->cpus, list);
+        return 1;
+    }
+
+    if (strncmp(arg, NUMA_OPTION, strlen(NUMA_OPTION)) == 0) {
+        const char *value = arg + strlen(NUMA_OPTION);
+        if (strcmp(value, "auto") == 0) {
+            placement->automatic = true;
+            placement->node = -1;
+            return 1;
+        }
+        char *end;
+        long node = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || node < 0 || node >= MAX_NUMA_NODES) {
+            fprintf(stderr, "Invalid NUMA node: %s\n", value);
+            return -1;
+        }
+        placement->node = (int)node;
+        placement->automatic = false;
+        return 1;
+    }
+
+    return 0;
+}
+
+static bool pid_alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// Read the placement state, dropping entries whose launcher is gone. Counts live containers per node.
+static int load_placement_state(FILE *fp, pid_t *pids, int *nodes, int max_entries, int *per_node) {
+    int entries = 0;
+    int pid, node;
+
+    rewind(fp);
+    while (entries < max_entries && fscanf(fp, "%d %d", &pid, &node) == 2) {
+        if (node < 0 || node >= MAX_NUMA_NODES || !pid_alive(pid)) {
+            continue;
+        }
+        pids[entries] = pid;
+        nodes[entries] = node;
+        per_node[node]++;
+        entries++;
+    }
+    return entries;
+}
+
+static void store_placement_state(FILE *fp, const pid_t *pids, const int *nodes, int entries) {
+    rewind(fp);
+    if (ftruncate(fileno(fp), 0) == -1) {
+        perror("ftruncate");
+        return;
+    }
+    for (int i = 0; i < entries; i++) {
+        fprintf(fp, "%d %d\n", pids[i], nodes[i]);
+    }
+    fflush(fp);
+}
+
+static FILE *lock_placement_state() {
+    if (ensure_private_dir(PLACEMENT_STATE_DIR) == -1) {
+        perror("Error creating placement state directory");
+        return NULL;
+    }
+    int fd = open(PLACEMENT_STATE_FILE, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("Error opening placement state");
+        return NULL;
+    }
+    if (flock(fd, LOCK_EX) == -1) {
+        perror("flock");
+        close(fd);
+        return NULL;
+    }
+    FILE *fp = fdopen(fd, "r+");
+    if (!fp) {
+        close(fd);
+    }
+    return fp;
+}
+
+// In automatic mode pick the node with the fewest running containers per CPU (ties go to the node
+// with more free memory) and record it against the launcher pid so concurrent launches spread out.
+int resolve_placement(Placement *placement) {
+    if (!placement->automatic) {
+        return 0;
+    }
+
+    cpu_set_t online;
+    if (read_sysfs_list(NODE_SYSFS_DIR "/online", &online) <= 0) {
+        fprintf(stderr, "[-] NUMA topology not available, ignoring --numa=auto\n");
+        return 0;
+    }
+
+    FILE *fp = lock_placement_state();
+    if (!fp) {
+        return -1;
+    }
+
+    static pid_t pids[MAX_PLACEMENT_ENTRIES];
+    static int nodes[MAX_PLACEMENT_ENTRIES];
+    int per_node[MAX_NUMA_NODES] = {0};
+    int entries = load_placement_state(fp, pids, nodes, MAX_PLACEMENT_ENTRIES - 1, per_node);
+
+    int best = -1;
+    int best_cpus = 0;
+    long best_free = 0;
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        if (!CPU_ISSET(node, &online)) continue;
+
+        cpu_set_t node_cpus;
+        int cpus = read_node_cpus(node, &node_cpus);
+        if (cpus <= 0) continue; // memory-only node
+
+        long free_kb = read_node_free_kb(node);
+        if (best == -1) {
+            best = node;
+            best_cpus = cpus;
+            best_free = free_kb;
+            continue;
+        }
+
+        long lhs = (long)per_node[node] * best_cpus;
+        long rhs = (long)per_node[best] * cpus;
+        if (lhs < rhs || (lhs == rhs && free_kb > best_free)) {
+            best = node;
+            best_cpus = cpus;
+            best_free = free_kb;
+        }
+    }
+
+    if (best != -1) {
+        pids[entries] = getpid();
+        nodes[entries] = best;
+        entries++;
+        placement->node = best;
+        printf("[*] Placing container on NUMA node %d (%d running there)\n", best, per_node[best]);
+    }
+    store_placement_state(fp, pids, nodes, entries);
+    fclose(fp); // --> releases the lock
+    return 0;
+}
+
+void release_placement(const Placement *placement) {
+    if (!placement->automatic || placement->node < 0) {
+        return;
+    }
+
+    FILE *fp = lock_placement_state();
+    if (!fp) {
+        return;
+    }
+
+    static pid_t pids[MAX_PLACEMENT_ENTRIES];
+    static int nodes[MAX_PLACEMENT_ENTRIES];
+    int per_node[MAX_NUMA_NODES] = {0};
+    int entries = load_placement_state(fp, pids, nodes, MAX_PLACEMENT_ENTRIES, per_node);
+
+    pid_t self = getpid();
+    int kept = 0;
+    for (int i = 0; i < entries; i++) {
+        if (pids[i] == self) continue;
+        pids[kept] = pids[i];
+        nodes[kept] = nodes[i];
+        kept++;
+    }
+    store_placement_state(fp, pids, nodes, kept);
+    fclose(fp);
+}
+
+// Called in the child before the image is fetched, so the rootfs pages are already allocated on
+// the chosen node by the time execv() runs.
+int apply_placement(const Placement *placement) {
+    cpu_set_t cpus;
+    bool have_cpus = false;
+
+    if (placement->cpus[0] != '\0') {
+        parse_id_list(placement->cpus, &cpus);
+        have_cpus = true;
+    }
+
+    if (placement->node >= 0) {
+        unsigned long nodemask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+        nodemask[placement->node / (8 * sizeof(unsigned long))] |= 1UL << (placement->node % (8 * sizeof(unsigned long)));
+
+        if (syscall(SYS_set_mempolicy, MPOL_BIND, nodemask, MAX_NUMA_NODES + 1) == -1) {
+            perror("set_mempolicy");
+            return -1;
+        }
+        if (!have_cpus) {
+            if (read_node_cpus(placement->node, &cpus) <= 0) {
+                fprintf(stderr, "Could not read CPUs of NUMA node %d\n", placement->node);
+                return -1;
+            }
+            have_cpus = true;
+        }
+    }
+
+    if (have_cpus && sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define PLACEMENT_STATE_DIR "/run/ldenv"
+#define PLACEMENT_STATE_FILE PLACEMENT_STATE_DIR "/placement"
+#define MAX_NUMA_NODES 64
+
+// CPU / NUMA placement requested for a container
+typedef struct Placement {
+    char cpus[256];     // CPU list ("0-3,8"), empty if not requested
+    int node;           // NUMA node to bind to, -1 if not requested
+    bool automatic;     // pick the least loaded node at launch time
+} Placement;
+
+void init_placement(Placement *placement);
+int parse_placement_option(const char *arg, Placement *placement);
+int resolve_placement(Placement *placement);
+int apply_placement(const Placement *placement);
+void release_placement(const Placement *placement);
+#endif
@@ -0,0 +1,543 @@
+#define _GNU_SOURCE // --> for strcasestr()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <curl/curl.h>
+#include "registryMirrors.h"
+#include "imageStore.h"
+#include "networking.h"
+#include "metrics.h"
+#include "sha256.h"
+#include "systemUtils.h"
+
+// Manifests and blobs can come from any registry in an ordered list of mirrors / pull-through
+// caches, Docker Hub always being the last one. Every request goes to the healthy mirror that is
+// expected to answer it fastest, judging by the smoothed latency and throughput of its earlier
+// requests (kept in the store's MIRROR_STATS_NAME so they outlive a single pull). A mirror that fails,
+// answers 429 or serves a blob that does not match its digest is skipped until its backoff runs out,
+// and the request moves on to the next one.
+
+#define MIRROR_OPTION "--mirror="
+#define MIRRORS_ENV "LDENV_MIRRORS"
+#define STATS_SMOOTHING 0.3                    // weight of the newest sample
+#define MIN_THROUGHPUT_SAMPLE (256 * 1024)     // smaller bodies say little about bandwidth
+#define BLOB_SIZE_ESTIMATE (16.0 * 1024 * 1024)
+#define MAX_BACKOFF 300                        // seconds
+#define CONNECT_TIMEOUT 10                     // seconds
+#define LOW_SPEED_LIMIT 1024                   // bytes per second ...
+#define LOW_SPEED_TIME 30                      // ... for this many seconds counts as stalled
+#define MAX_STATS_ENTRIES 64
+#define SHA256_DIGEST_PREFIX "sha256:"
+
+typedef struct Mirror {
+    char url[512];
+    char auth_url[1024];    // token endpoint up to the repository name, empty if the mirror wants no token
+    char *token;
+    char token_image[256];  // tokens are scoped to one repository
+    CURL *curl;             // kept so connections are reused between requests
+    double latency;         // smoothed time to first byte in seconds, 0 until measured
+    double throughput;      // smoothed bytes per second of large bodies, 0 until measured
+    int failures;           // consecutive failures
+    time_t retry_at;        // only used as a last resort before this time
+} Mirror;
+
+typedef struct RegistrySink {
+    ResponseBuffer *buffer;
+    FILE *fp;
+    const char *sha256_hex;  // expected digest of the body written to fp, or NULL
+    Sha256Context hash;
+} RegistrySink;
+
+static char *mirror_options[MAX_MIRRORS];
+static int mirror_option_count = 0;
+
+static Mirror mirrors[MAX_MIRRORS];
+static int mirror_count = 0;
+static bool mirrors_loaded = false;
+static char stats_path[1024] = "";  // empty if the stats can't be kept
+
+// --mirror=<url> adds a registry in front of the ones from LDENV_MIRRORS, can be given several times
+int parse_mirror_option(const char *arg) {
+    if (strncmp(arg, MIRROR_OPTION, strlen(MIRROR_OPTION)) != 0) {
+        return 0;
+    }
+    const char *value = arg + strlen(MIRROR_OPTION);
+    if (strncmp(value, "http://", 7) != 0 && strncmp(value, "https://", 8) != 0) {
+        fprintf(stderr, "Invalid mirror URL: %s (expected http:// or https://)\n", value);
+        return -1;
+    }
+    if (mirror_option_count == MAX_MIRRORS - 1) {
+        fprintf(stderr, "Too many mirrors, at most %d can be given\n", MAX_MIRRORS - 1);
+        return -1;
+    }
+    mirror_options[mirror_option_count++] = (char *)value;
+    return 1;
+}
+
+static void add_mirror(const char *url, size_t len, const char *auth_url) {
+    while (len > 0 && url[len - 1] == '/') len--;
+    if (len == 0 || len >= sizeof(mirrors[0].url) || mirror_count == MAX_MIRRORS) {
+        return;
+    }
+    if (strncmp(url, "http://", 7) != 0 && strncmp(url, "https://", 8) != 0) {
+        fprintf(stderr, "[-] Ignoring mirror %.*s: expected http:// or https://\n", (int)len, url);
+        return;
+    }
+    for (int i = 0; i < mirror_count; i++) {
+        if (strlen(mirrors[i].url) == len && strncmp(mirrors[i].url, url, len) == 0) return;
+    }
+
+    Mirror *mirror = &mirrors[mirror_count++];
+    memset(mirror, 0, sizeof(*mirror));
+    memcpy(mirror->url, url, len);
+    mirror->url[len] = '\0';
+    snprintf(mirror->auth_url, sizeof(mirror->auth_url), "%s", auth_url ? auth_url : "");
+}
+
+static FILE *lock_mirror_stats(int operation) {
+    if (stats_path[0] == '\0') {
+        return NULL;
+    }
+    int fd = open(stats_path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (flock(fd, operation) == -1) {
+        close(fd);
+        return NULL;
+    }
+    FILE *fp = fdopen(fd, "r+");
+    if (!fp) {
+        close(fd);
+    }
+    return fp;
+}
+
+static void load_mirror_stats() {
+    FILE *fp = lock_mirror_stats(LOCK_SH);
+    if (!fp) {
+        return;
+    }
+    char url[512];
+    double latency, throughput;
+    int failures;
+    long retry_at;
+    while (fscanf(fp, "%511s %lf %lf %d %ld", url, &latency, &throughput, &failures, &retry_at) == 5) {
+        for (int i = 0; i < mirror_count; i++) {
+            if (strcmp(mirrors[i].url, url) != 0) continue;
+            mirrors[i].latency = latency;
+            mirrors[i].throughput = throughput;
+            mirrors[i].failures = failures;
+            mirrors[i].retry_at = (time_t)retry_at;
+        }
+    }
+    fclose(fp);
+}
+
+// Write back the stats of one mirror, keeping what other launchers recorded for the rest
+static void save_mirror_stats(const Mirror *mirror) {
+    FILE *fp = lock_mirror_stats(LOCK_EX);
+    if (!fp) {
+        return;
+    }
+
+    static char lines[MAX_STATS_ENTRIES][1024];
+    int count = 0;
+    char line[1024];
+    char url[512];
+    while (count < MAX_STATS_ENTRIES - 1 && fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%511s", url) != 1 || strcmp(url, mirror->url) == 0) continue;
+        snprintf(lines[count++], sizeof(lines[0]), "%s", line);
+    }
+    snprintf(lines[count++], sizeof(lines[0]), "%s %.6f %.1f %d %ld\n", mirror->url, mirror->latency,
+             mirror->throughput, mirror->failures, (long)mirror->retry_at);
+
+    rewind(fp);
+    if (ftruncate(fileno(fp), 0) == 0) {
+        for (int i = 0; i < count; i++) {
+            fputs(lines[i], fp);
+        }
+    }
+    fclose(fp); // --> releases the lock
+}
+
+static int init_mirrors() {
+    if (mirrors_loaded) {
+        return 0;
+    }
+    mirror_count = 0;
+    for (int i = 0; i < mirror_option_count; i++) {
+        add_mirror(mirror_options[i], strlen(mirror_options[i]), NULL);
+    }
+    const char *list = getenv(MIRRORS_ENV);
+    while (list && *list) {
+        size_t len = strcspn(list, ", \t\n");
+        add_mirror(list, len, NULL);
+        list += len;
+        list += strspn(list, ", \t\n");
+    }
+    add_mirror(DEFAULT_REGISTRY_URL, strlen(DEFAULT_REGISTRY_URL), DEFAULT_AUTH_URL);
+
+    stats_path[0] = '\0';
+    if (ensure_private_dir(image_store_dir()) == 0) {
+        snprintf(stats_path, sizeof(stats_path), "%s/" MIRROR_STATS_NAME, image_store_dir());
+    }
+    load_mirror_stats();
+    mirrors_loaded = true;
+    return 0;
+}
+
+void release_mirrors() {
+    for (int i = 0; i < mirror_count; i++) {
+        free(mirrors[i].token);
+        if (mirrors[i].curl) curl_easy_cleanup(mirrors[i].curl);
+    }
+    mirror_count = 0;
+    mirrors_loaded = false;
+}
+
+// Expected seconds for a mirror to serve expected_bytes, unmeasured mirrors come first so they get measured
+static double mirror_cost(const Mirror *mirror, double expected_bytes) {
+    if (mirror->latency == 0) {
+        return -1;
+    }
+    double cost = mirror->latency;
+    if (mirror->throughput > 0) {
+        cost += expected_bytes / mirror->throughput;
+    }
+    return cost;
+}
+
+// Order the mirrors: healthy ones by expected cost, then the backed off ones by when they recover.
+// The sort is stable so the configured order breaks ties.
+static void rank_mirrors(double expected_bytes, int *order) {
+    time_t now = time(NULL);
+    for (int i = 0; i < mirror_count; i++) {
+        int j = i;
+        while (j > 0) {
+            const Mirror *prev = &mirrors[order[j - 1]];
+            const Mirror *cur = &mirrors[i];
+            bool prev_healthy = prev->retry_at <= now;
+            bool cur_healthy = cur->retry_at <= now;
+            bool before;
+            if (prev_healthy != cur_healthy) {
+                before = cur_healthy;
+            } else if (cur_healthy) {
+                before = mirror_cost(cur, expected_bytes) < mirror_cost(prev, expected_bytes);
+            } else {
+                before = cur->retry_at < prev->retry_at;
+            }
+            if (!before) break;
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+}
+
+static void record_success(Mirror *mirror, double first_byte, double total, double bytes) {
+    mirror->latency = mirror->latency == 0 ? first_byte : STATS_SMOOTHING * first_byte + (1 - STATS_SMOOTHING) * mirror->latency;
+    if (mirror->latency <= 0) {
+        mirror->latency = 1e-6; // --> 0 means unmeasured
+    }
+    double transfer = total - first_byte;
+    if (bytes >= MIN_THROUGHPUT_SAMPLE && transfer > 0) {
+        double sample = bytes / transfer;
+        mirror->throughput = mirror->throughput == 0 ? sample : STATS_SMOOTHING * sample + (1 - STATS_SMOOTHING) * mirror->throughput;
+    }
+    mirror->failures = 0;
+    mirror->retry_at = 0;
+    save_mirror_stats(mirror);
+}
+
+// Back off exponentially, or for as long as the registry asked with Retry-After
+static void record_failure(Mirror *mirror, long retry_after) {
+    mirror->failures++;
+    long backoff = retry_after > 0 ? retry_after : 1L << (mirror->failures < 9 ? mirror->failures : 9);
+    if (backoff > MAX_BACKOFF) {
+        backoff = MAX_BACKOFF;
+    }
+    mirror->retry_at = time(NULL) + backoff;
+    save_mirror_stats(mirror);
+}
+
+static size_t challenge_header_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
+    size_t len = size * nitems;
+    const char *name = "WWW-Authenticate:";
+    if (len > strlen(name) && strncasecmp(buffer, name, strlen(name)) == 0) {
+        char *challenge = userdata;
+        const char *value = buffer + strlen(name);
+        size_t value_len = len - strlen(name);
+        while (value_len > 0 && isspace((unsigned char)*value)) {
+            value++;
+            value_len--;
+        }
+        while (value_len > 0 && isspace((unsigned char)value[value_len - 1])) value_len--;
+        if (value_len >= 1024) value_len = 1023;
+        memcpy(challenge, value, value_len);
+        challenge[value_len] = '\0';
+    }
+    return len;
+}
+
+static bool challenge_param(const char *challenge, const char *key, char *value, size_t size) {
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "%s=\"", key);
+    const char *start = strcasestr(challenge, pattern);
+    if (!start) {
+        return false;
+    }
+    start += strlen(pattern);
+    const char *end = strchr(start, '"');
+    if (!end || (size_t)(end - start) >= size) {
+        return false;
+    }
+    memcpy(value, start, end - start);
+    value[end - start] = '\0';
+    return true;
+}
+
+// Turn 'Bearer realm="https://auth/token",service="registry"' into the mirror's token endpoint
+static bool use_challenge(Mirror *mirror, const char *challenge) {
+    char realm[512];
+    char service[256];
+    if (strncasecmp(challenge, "Bearer ", 7) != 0 || !challenge_param(challenge, "realm", realm, sizeof(realm))) {
+        return false;
+    }
+    char separator = strchr(realm, '?') ? '&' : '?';
+    if (challenge_param(challenge, "service", service, sizeof(service))) {
+        snprintf(mirror->auth_url, sizeof(mirror->auth_url), "%s%cservice=%s&scope=repository:", realm, separator, service);
+    } else {
+        snprintf(mirror->auth_url, sizeof(mirror->auth_url), "%s%cscope=repository:", realm, separator);
+    }
+    return true;
+}
+
+static size_t sink_file_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+    RegistrySink *sink = userp;
+    size_t written = fwrite(contents, size, nmemb, sink->fp);
+    if (sink->sha256_hex) {
+        sha256_update(&sink->hash, contents, written * size);
+    }
+    return written;
+}
+
+static bool sink_matches_digest(RegistrySink *sink) {
+    if (!sink->sha256_hex) {
+        return true;
+    }
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_HEX_SIZE];
+    sha256_final(&sink->hash, digest);
+    sha256_to_hex(digest, hex);
+    return strcmp(hex, sink->sha256_hex) == 0;
+}
+
+static void reset_sink(RegistrySink *sink) {
+    if (sink->buffer) {
+        sink->buffer->size = 0;
+        sink->buffer->data[0] = '\0';
+    }
+    if (sink->fp) {
+        fflush(sink->fp);
+        rewind(sink->fp);
+        if (ftruncate(fileno(sink->fp), 0) == -1) {
+            perror("ftruncate");
+        }
+    }
+    sha256_init(&sink->hash);
+}
+
+// One GET against one mirror, returns the HTTP status or -1 if the transfer itself failed
+static long perform_request(Mirror *mirror, const char *url, RegistrySink *sink, char *challenge, long *retry_after,
+                            double *first_byte, double *total, double *bytes) {
+    if (!mirror->curl) {
+        mirror->curl = curl_easy_init();
+        if (!mirror->curl) {
+            fprintf(stderr, "Failed to initialize libcurl\n");
+            return -1;
+        }
+    } else {
+        curl_easy_reset(mirror->curl); // --> keeps the open connections
+    }
+    CURL *curl = mirror->curl;
+
+    struct curl_slist *headers = NULL;
+    headers = curl_slist_append(headers, ACCEPT_HEADER);
+    if (mirror->token) {
+        char auth_header[strlen(mirror->token) + strlen(AUTH_PREFIX) + 1];
+        snprintf(auth_header, sizeof(auth_header), "%s%s", AUTH_PREFIX, mirror->token);
+        headers = curl_slist_append(headers, auth_header);
+    }
+
+    challenge[0] = '\0';
+    reset_sink(sink);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    // Blobs are usually redirected to a CDN, libcurl does not send the token to other hosts
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)CONNECT_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long)LOW_SPEED_LIMIT);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)LOW_SPEED_TIME);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, challenge_header_callback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, challenge);
+    if (sink->fp) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, sink_file_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, sink);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, sink->buffer);
+    }
+
+    CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(headers);
+    if (sink->fp) {
+        fflush(sink->fp);
+    }
+
+    long status = 0, redirects = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(curl, CURLINFO_REDIRECT_COUNT, &redirects);
+    metrics_count_http_response(status);
+    metrics_count_redirects(redirects);
+    curl_off_t retry = 0, start_us = 0, total_us = 0, size = 0;
+    curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &start_us);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total_us);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &size);
+    *retry_after = (long)retry;
+    *first_byte = start_us / 1e6;
+    *total = total_us / 1e6;
+    *bytes = (double)size;
+
+    if (res != CURLE_OK && res != CURLE_HTTP_RETURNED_ERROR) {
+        fprintf(stderr, "[-] %s: %s\n", mirror->url, curl_easy_strerror(res));
+        return -1;
+    }
+    return status;
+}
+
+// Fetch through one mirror, getting (or renewing) its token when the mirror asks for one
+static int request_from_mirror(Mirror *mirror, const char *image_name, const char *path, RegistrySink *sink) {
+    if (mirror->token && strcmp(mirror->token_image, image_name) != 0) {
+        free(mirror->token);
+        mirror->token = NULL;
+    }
+
+    char url[2048];
+    snprintf(url, sizeof(url), "%s/v2/%s/%s", mirror->url, image_name, path);
+
+    char challenge[1024];
+    long status = -1, retry_after = 0;
+    double first_byte = 0, total = 0, bytes = 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!mirror->token && mirror->auth_url[0]) {
+            mirror->token = get_auth_token(mirror->auth_url, image_name);
+            if (!mirror->token) {
+                status = -1;
+                break;
+            }
+            snprintf(mirror->token_image, sizeof(mirror->token_image), "%s", image_name);
+        }
+
+        status = perform_request(mirror, url, sink, challenge, &retry_after, &first_byte, &total, &bytes);
+        if (status != 401 || attempt == 1) {
+            break;
+        }
+        // No token yet, or it expired: follow the challenge once
+        free(mirror->token);
+        mirror->token = NULL;
+        if (challenge[0] && !use_challenge(mirror, challenge)) {
+            break;
+        }
+        if (!mirror->auth_url[0]) {
+            break;
+        }
+    }
+
+    if (status == 200 && !sink_matches_digest(sink)) {
+        // Plain http mirrors and caches can hand out anything, only the digest makes a blob trustworthy
+        fprintf(stderr, "[-] %s: %s does not match its digest\n", mirror->url, path);
+        record_failure(mirror, 0);
+        return -1;
+    }
+    if (status == 200) {
+        metrics_count_download((uint64_t)bytes, sink->fp != NULL);
+        record_success(mirror, first_byte, total, bytes);
+        return 0;
+    }
+    if (status > 0) {
+        fprintf(stderr, "[-] %s: HTTP request failed with status code: %ld\n", mirror->url, status);
+    }
+    // A mirror that does not have the image is not unhealthy
+    if (status != 404) {
+        record_failure(mirror, status == 429 ? retry_after : 0);
+    }
+    return -1;
+}
+
+static int registry_request(const char *image_name, const char *path, const char *purpose, RegistrySink *sink, double expected_bytes) {
+    if (init_mirrors() == -1) {
+        return -1;
+    }
+
+    int order[MAX_MIRRORS];
+    rank_mirrors(expected_bytes, order);
+    for (int i = 0; i < mirror_count; i++) {
+        Mirror *mirror = &mirrors[order[i]];
+        if (request_from_mirror(mirror, image_name, path, sink) == 0) {
+            printf("[+] %c%s fetched from %s (%.0f ms to first byte).\n", toupper((unsigned char)purpose[0]), purpose + 1,
+                   mirror->url, mirror->latency * 1000);
+            return 0;
+        }
+        if (i + 1 < mirror_count) {
+            metrics_count_failover();
+            printf("[*] Failing over to %s\n", mirrors[order[i + 1]].url);
+        }
+    }
+    fprintf(stderr, "[-] No registry could serve %s of %s.\n", purpose, image_name);
+    return -1;
+}
+
+// GET /v2/<image>/<path> from the best mirror, returns the body (to be freed) or NULL
+char *registry_get(const char *image_name, const char *path, const char *purpose) {
+    ResponseBuffer buffer = {
+        .data = malloc(1),
+        .size = 0
+    };
+    if (!buffer.data) {
+        fprintf(stderr, "Failed to initialize response buffer\n");
+        return NULL;
+    }
+    buffer.data[0] = '\0';
+
+    RegistrySink sink = { .buffer = &buffer, .fp = NULL };
+    if (registry_request(image_name, path, purpose, &sink, 0) == -1) {
+        free(buffer.data);
+        return NULL;
+    }
+    return buffer.data;
+}
+
+// Like registry_get() but the body goes to fp, which is truncated again before every failover.
+// With a "sha256:<hex>" digest, a body that doesn't match it counts as a failure of that mirror.
+int registry_download(const char *image_name, const char *path, FILE *fp, const char *digest) {
+    RegistrySink sink = { .buffer = NULL, .fp = fp, .sha256_hex = NULL };
+    if (digest) {
+        size_t prefix_len = strlen(SHA256_DIGEST_PREFIX);
+        if (strncmp(digest, SHA256_DIGEST_PREFIX, prefix_len) != 0 || strlen(digest + prefix_len) != SHA256_HEX_SIZE - 1) {
+            fprintf(stderr, "Unsupported layer digest: %s\n", digest);
+            return -1;
+        }
+        sink.sha256_hex = digest + prefix_len;
+    }
+    return registry_request(image_name, path, "layer", &sink, BLOB_SIZE_ESTIMATE);
+}
@@ -0,0 +1,15 @@
+#ifndef REGISTRYMIRRORS_H
+#define REGISTRYMIRRORS_H
+
+#include <stdio.h>
+
+#define DEFAULT_REGISTRY_URL "https://registry.hub.docker.com"
+#define DEFAULT_AUTH_URL "https://auth.docker.io/token?service=registry.docker.io&scope=repository:"
+#define MIRROR_STATS_NAME "mirror_stats"   // kept in the image store directory
+#define MAX_MIRRORS 16
+
+int parse_mirror_option(const char *arg);
+char *registry_get(const char *image_name, const char *path, const char *purpose);
+int registry_download(const char *image_name, const char *path, FILE *fp, const char *digest);
+void release_mirrors();
+#endif
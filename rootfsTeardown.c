@@ -0,0 +1,398 @@
+#define _GNU_SOURCE // --> for mkdtemp() and O_DIRECTORY
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "rootfsTeardown.h"
+#include "imageStore.h"
+#include "systemUtils.h"
+
+// A rootfs directory is flock()ed by the launcher for its whole life, and the lock is inherited
+// by the container (the fd is the container's own root, so it gives no way out of the chroot).
+// An unlocked rootfs therefore belongs to nobody and can be swept. Teardown only renames the tree
+// into the trash; a detached reaper at idle priority does the actual deletion. The trash must be a
+// root-only directory, and the reaper walks it with openat()/unlinkat() from directory fds, so a
+// user swapping a path component for a symlink can't make it delete anything outside.
+
+#define MAX_REAPER_THREADS 8
+#define MAX_PENDING_DIRS 256  // directories queued for the reaper threads, each holds an open fd
+
+// Rootfs directories are created in <store>/containers: a checkout copied within one filesystem
+// shares extents with the stored rootfs where the filesystem can reflink
+const char *rootfs_parent_dir() {
+    static char path[PATH_MAX];
+    if (!*path) {
+        snprintf(path, sizeof(path), "%s/" ROOTFS_PARENT_NAME, image_store_dir());
+    }
+    return path;
+}
+
+static const char *trash_dir() {
+    static char path[PATH_MAX + sizeof(TRASH_NAME) + 1];
+    if (!*path) {
+        snprintf(path, sizeof(path), "%s/" TRASH_NAME, rootfs_parent_dir());
+    }
+    return path;
+}
+
+// mkdtemp() the rootfs directory (template is in rootfs_parent_dir()) and lock it, the returned fd
+// must stay open while it is in use
+char *create_rootfs_dir(char *template, int *lock_fd) {
+    if (ensure_private_dir(rootfs_parent_dir()) == -1) {
+        return NULL;
+    }
+    char *dir_name = mkdtemp(template);
+    if (!dir_name) {
+        return NULL;
+    }
+    *lock_fd = open(dir_name, O_RDONLY | O_DIRECTORY);
+    if (*lock_fd == -1 || flock(*lock_fd, LOCK_EX) == -1) {
+        if (*lock_fd != -1) close(*lock_fd);
+        rmdir(dir_name);
+        return NULL;
+    }
+    return dir_name;
+}
+
+// Open the trash, creating it if needed. It has to be a directory owned by us that nobody else can
+// write to, otherwise -1 is returned. Anything else is made 0700.
+static int open_trash() {
+    if (ensure_private_dir(trash_dir()) == -1) {
+        return -1;
+    }
+    int fd = open(trash_dir(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_uid != geteuid()) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    if ((st.st_mode & 077) != 0) {
+        fchmod(fd, 0700);
+    }
+    return fd;
+}
+
+// Move a finished rootfs into the trash, this is a single rename no matter how big the tree is.
+// Without a usable trash the rootfs is deleted right away.
+int discard_rootfs(const char *dir_name) {
+    const char *base = strrchr(dir_name, '/');
+    base = base ? base + 1 : dir_name;
+
+    int trash_fd = open_trash();
+    if (trash_fd != -1 && renameat(AT_FDCWD, dir_name, trash_fd, base) == 0) {
+        close(trash_fd);
+        return 0;
+    }
+    if (trash_fd != -1) {
+        perror("Error moving rootfs to trash");
+        close(trash_fd);
+    }
+    if (remove_tree_at(AT_FDCWD, dir_name) == -1) {
+        fprintf(stderr, "Error removing %s: %s\n", dir_name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static bool rootfs_in_use(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    bool in_use = flock(fd, LOCK_EX | LOCK_NB) == -1;
+    close(fd);
+    return in_use;
+}
+
+// Move rootfs directories left behind by crashed runs (and their layer staging directories) to the trash
+void sweep_stale_rootfs() {
+    const char *parent = rootfs_parent_dir();
+    DIR *dir = opendir(parent);
+    if (!dir) {
+        return;
+    }
+
+    time_t now = time(NULL);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, ROOTFS_PREFIX, strlen(ROOTFS_PREFIX)) != 0) continue;
+
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", parent, entry->d_name) >= (int)sizeof(path)) continue;
+        struct stat st;
+        if (lstat(path, &st) == -1 || st.st_uid != geteuid() || now - st.st_ctime < STALE_ROOTFS_AGE) {
+            continue;
+        }
+
+        // Staging directories ("<rootfs>.layerN_XXXXXX") and their directory lists are only stale
+        // once their rootfs is
+        char owner[PATH_MAX];
+        snprintf(owner, sizeof(owner), "%s", path);
+        char *layer_suffix = strstr(owner + strlen(parent) + 1, ".layer");
+        if (layer_suffix) *layer_suffix = '\0';
+
+        if (!S_ISDIR(st.st_mode)) {
+            if (layer_suffix && S_ISREG(st.st_mode) && !rootfs_in_use(owner)) {
+                unlink(path);
+            }
+            continue;
+        }
+        if (rootfs_in_use(owner)) continue;
+        if (discard_rootfs(path) == 0) {
+            printf("[*] Removing stale %s\n", path);
+        }
+    }
+    closedir(dir);
+}
+
+//REAPER
+
+// One directory being deleted. Directories are only named relative to their parent's fd, which
+// stays open until every child is gone, so nothing is ever looked up by a path string again.
+typedef struct ReapDir {
+    struct ReapDir *parent;  // NULL for the tree's root, which lives in parent_fd
+    int parent_fd;
+    int fd;
+    int remaining;           // subdirectories not removed yet, +1 while it is being emptied
+    struct ReapDir *next;    // pending list
+    char name[];
+} ReapDir;
+
+typedef struct ReapQueue {
+    ReapDir *pending;        // directories still to be emptied
+    int pending_count;
+    int active;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ReapQueue;
+
+static ReapDir *new_reap_dir(ReapDir *parent, int parent_fd, const char *name) {
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    ReapDir *dir = calloc(1, sizeof(ReapDir) + strlen(name) + 1);
+    if (!dir) {
+        close(fd);
+        return NULL;
+    }
+    dir->parent = parent;
+    dir->parent_fd = parent_fd;
+    dir->fd = fd;
+    dir->remaining = 1;
+    strcpy(dir->name, name);
+    return dir;
+}
+
+static void queue_directory(ReapQueue *queue, ReapDir *dir) {
+    dir->next = queue->pending;
+    queue->pending = dir;
+    queue->pending_count++;
+    pthread_cond_signal(&queue->changed);
+}
+
+// Drop one reference from dir, removing it (and then any parent that became empty) when it was the last.
+// Called with the queue locked.
+static void release_directory(ReapDir *dir) {
+    while (dir && --dir->remaining == 0) {
+        close(dir->fd);
+        unlinkat(dir->parent_fd, dir->name, AT_REMOVEDIR);
+        ReapDir *parent = dir->parent;
+        free(dir);
+        dir = parent;
+    }
+}
+
+// unlinkat() every non-directory of one directory and queue its subdirectories for other workers.
+// Once MAX_PENDING_DIRS are queued (each holds an fd) subdirectories are removed right here instead.
+static void empty_directory(ReapQueue *queue, ReapDir *reap_dir) {
+    int fd = dup(reap_dir->fd);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd != -1) close(fd);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        bool is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(reap_dir->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (!is_dir) {
+            unlinkat(reap_dir->fd, entry->d_name, 0);
+            continue;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        bool room = queue->pending_count < MAX_PENDING_DIRS;
+        pthread_mutex_unlock(&queue->lock);
+        ReapDir *child = room ? new_reap_dir(reap_dir, reap_dir->fd, entry->d_name) : NULL;
+        if (!child) {
+            remove_tree_at(reap_dir->fd, entry->d_name);
+            continue;
+        }
+        pthread_mutex_lock(&queue->lock);
+        reap_dir->remaining++;
+        queue_directory(queue, child);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    closedir(dir);
+}
+
+static void *reap_worker(void *arg) {
+    ReapQueue *queue = arg;
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        while (queue->pending_count == 0 && queue->active > 0) {
+            pthread_cond_wait(&queue->changed, &queue->lock);
+        }
+        if (queue->pending_count == 0) {
+            break; // nothing queued and nobody left to queue more
+        }
+        ReapDir *dir = queue->pending;
+        queue->pending = dir->next;
+        queue->pending_count--;
+        queue->active++;
+        pthread_mutex_unlock(&queue->lock);
+
+        empty_directory(queue, dir);
+
+        pthread_mutex_lock(&queue->lock);
+        release_directory(dir);
+        queue->active--;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+// Delete the tree name (in parent_fd) with several threads. Files are unlinked in parallel, and each
+// directory is removed by whichever thread finishes its last subdirectory.
+static void remove_tree_parallel(int parent_fd, const char *name) {
+    ReapDir *root = new_reap_dir(NULL, parent_fd, name);
+    if (!root) {
+        remove_tree_at(parent_fd, name);
+        return;
+    }
+
+    ReapQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.changed, NULL);
+    queue_directory(&queue, root);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = cpus < 2 ? 2 : (cpus > MAX_REAPER_THREADS ? MAX_REAPER_THREADS : (int)cpus);
+    pthread_t threads[MAX_REAPER_THREADS];
+    int started = 0;
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, reap_worker, &queue) == 0) started++;
+    }
+    if (started == 0) {
+        reap_worker(&queue);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.changed);
+}
+
+// Empty the trash until nothing is left, only one reaper runs at a time
+static void reap_trash() {
+    int trash_fd = open_trash();
+    if (trash_fd == -1 || flock(trash_fd, LOCK_EX | LOCK_NB) == -1) {
+        if (trash_fd != -1) close(trash_fd);
+        return;
+    }
+
+    bool found = true;
+    while (found) {
+        found = false;
+        int fd = dup(trash_fd);
+        DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+        if (!dir) {
+            if (fd != -1) close(fd);
+            break;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            if (unlinkat(trash_fd, entry->d_name, 0) == -1) {
+                remove_tree_parallel(trash_fd, entry->d_name);
+            }
+            // Rescan only while progress is made, something undeletable must not spin forever
+            if (faccessat(trash_fd, entry->d_name, F_OK, AT_SYMLINK_NOFOLLOW) == -1) {
+                found = true;
+            }
+        }
+        closedir(dir);
+    }
+    close(trash_fd);
+}
+
+// Start the reaper as a detached grandchild that waits until the returned fd is closed (by
+// trigger_reaper() or by the launcher exiting). It has to be forked before the launcher calls
+// unshare(CLONE_NEWPID): once the container's init exits no more processes can be forked there.
+int spawn_reaper() {
+    int trigger[2];
+    if (pipe2(trigger, O_CLOEXEC) == -1) {
+        perror("error creating pipes!");
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Error forking!");
+        close(trigger[0]);
+        close(trigger[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        if (fork() == 0) {
+            close(trigger[1]);
+            setsid();
+            int null_fd = open("/dev/null", O_RDWR);
+            if (null_fd != -1) {
+                dup2(null_fd, STDIN_FILENO);
+                dup2(null_fd, STDOUT_FILENO);
+                dup2(null_fd, STDERR_FILENO);
+                if (null_fd > STDERR_FILENO) close(null_fd);
+            }
+
+            char c;
+            while (read(trigger[0], &c, 1) == -1 && errno == EINTR) {}
+            close(trigger[0]);
+
+            set_background_priority();
+            reap_trash();
+        }
+        _exit(0);
+    }
+    close(trigger[0]);
+    waitpid(pid, NULL, 0);
+    return trigger[1];
+}
+
+// Let the reaper empty the trash, the caller does not wait for it
+void trigger_reaper(int reaper_fd) {
+    if (reaper_fd != -1) {
+        close(reaper_fd);
+    }
+}
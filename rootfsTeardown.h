@@ -0,0 +1,15 @@
+#ifndef ROOTFSTEARDOWN_H
+#define ROOTFSTEARDOWN_H
+
+#define ROOTFS_PARENT_NAME "containers"   // below the image store, so checkouts can reflink from it
+#define ROOTFS_PREFIX "mydir_"
+#define TRASH_NAME ".ldenv_trash"   // next to the rootfs directories (same filesystem), root only
+#define STALE_ROOTFS_AGE 10   // seconds an unlocked rootfs must be left alone before it is swept
+
+const char *rootfs_parent_dir();
+char *create_rootfs_dir(char *template, int *lock_fd);
+int discard_rootfs(const char *dir_name);
+void sweep_stale_rootfs();
+int spawn_reaper();
+void trigger_reaper(int reaper_fd);
+#endif
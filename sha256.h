@@ -0,0 +1,22 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE (SHA256_DIGEST_SIZE * 2 + 1)
+
+typedef struct Sha256Context {
+    uint32_t state[8];
+    uint64_t length;        // Total message length in bytes
+    uint8_t block[64];
+    size_t block_used;
+} Sha256Context;
+
+void sha256_init(Sha256Context *ctx);
+void sha256_update(Sha256Context *ctx, const void *data, size_t len);
+void sha256_final(Sha256Context *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char hex[SHA256_HEX_SIZE]);
+int sha256_file_hex(const char *path, char hex[SHA256_HEX_SIZE]);
+#endif
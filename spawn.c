@@ -0,0 +1,215 @@
+#define _GNU_SOURCE // --> for the CLONE_NEW* flags and W_EXITCODE()
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/sched.h>
+#include "spawn.h"
+#include "metrics.h"
+
+// The clone3() path leaves the launcher's own namespaces alone: the child is created directly in new
+// PID, mount, UTS and IPC namespaces (and optionally in a cgroup). It is a real vfork: with CLONE_VM
+// the child runs in the launcher's memory on a small stack of its own, so no page tables are copied
+// however big the launcher has grown by fetching and checking out the rootfs, and with CLONE_VFORK
+// the launcher sleeps until the child has called execv(). The child only redirects its output,
+// chroots and execs, a failure is handed back through memory for the launcher to report. The
+// launcher installs no signal handlers, so none can run in the child on the shared memory.
+// The returned pidfd is used to wait for the container, it can't be confused with a reused pid.
+
+#define SPAWN_OPTION "--spawn="
+#define CGROUP_OPTION "--cgroup="
+#define CONTAINER_NAMESPACES (CLONE_NEWPID | CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWIPC)
+#define CHILD_STACK_SIZE (32 * 1024)
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+static SpawnMode mode = SPAWN_CLONE3;
+static const char *cgroup_dir = NULL;
+
+// --spawn=clone3|fork picks the spawn path, --cgroup=<cgroup2 dir> starts the container in that cgroup
+int parse_spawn_option(const char *arg) {
+    if (strncmp(arg, CGROUP_OPTION, strlen(CGROUP_OPTION)) == 0) {
+        cgroup_dir = arg + strlen(CGROUP_OPTION);
+        if (*cgroup_dir == '\0') {
+            fprintf(stderr, "Missing cgroup directory\n");
+            return -1;
+        }
+        return 1;
+    }
+    if (strncmp(arg, SPAWN_OPTION, strlen(SPAWN_OPTION)) != 0) {
+        return 0;
+    }
+    const char *value = arg + strlen(SPAWN_OPTION);
+    if (strcmp(value, "clone3") == 0) {
+        mode = SPAWN_CLONE3;
+    } else if (strcmp(value, "fork") == 0) {
+        mode = SPAWN_FORK;
+    } else {
+        fprintf(stderr, "Unknown spawn path: %s (expected clone3 or fork)\n", value);
+        return -1;
+    }
+    return 1;
+}
+
+SpawnMode spawn_mode() {
+    if (mode == SPAWN_FORK && cgroup_dir) {
+        fprintf(stderr, "[-] --cgroup needs the clone3 spawn path, using it\n");
+        mode = SPAWN_CLONE3;
+    }
+    return mode;
+}
+
+// What the child gets from the launcher, and where it leaves the step that failed
+typedef struct ExecRequest {
+    const char *dir_name;
+    char *const *argv;
+    int stdout_fd;
+    int stderr_fd;
+    const char *failed_step;
+    int error;
+} ExecRequest;
+
+// Runs in the child between clone and exec, on the launcher's memory: only the four syscalls, no
+// stdio. CPU affinity and memory policy are inherited from the launcher.
+static int exec_container(void *arg) {
+    ExecRequest *request = arg;
+    if (dup2(request->stdout_fd, STDOUT_FILENO) == -1 || dup2(request->stderr_fd, STDERR_FILENO) == -1) {
+        request->failed_step = "Error redirecting the container output";
+    } else if (chdir(request->dir_name) || chroot(request->dir_name)) {
+        request->failed_step = "Error, could not chroot to new directory";
+    } else {
+        execv(request->argv[0], request->argv);
+        request->failed_step = "\nexec error";
+    }
+    request->error = errno;
+    _exit(-1);
+}
+
+// clone3() with the child on its own stack (args->stack): the child runs fn(arg), which must not
+// return. The raw syscall can't be used for this, the child would return into the launcher's frames.
+static long clone3_on_stack(struct clone_args *args, int (*fn)(void *), void *arg) {
+#if defined(__x86_64__)
+    register long rax __asm__("rax") = SYS_clone3;
+    register struct clone_args *rdi __asm__("rdi") = args;
+    register size_t rsi __asm__("rsi") = sizeof(*args);
+    register int (*r12)(void *) __asm__("r12") = fn;
+    register void *r13 __asm__("r13") = arg;
+    __asm__ volatile("syscall\n\t"
+                     "test %%rax, %%rax\n\t"
+                     "jnz 1f\n\t"
+                     "xor %%ebp, %%ebp\n\t" // --> child: outermost frame on the new stack
+                     "mov %%r13, %%rdi\n\t"
+                     "call *%%r12\n\t"
+                     "hlt\n"
+                     "1:"
+                     : "+r"(rax)
+                     : "r"(rdi), "r"(rsi), "r"(r12), "r"(r13)
+                     : "rcx", "r11", "memory");
+    if (rax < 0) {
+        errno = (int)-rax;
+        return -1;
+    }
+    return rax;
+#else
+    (void)args;
+    (void)fn;
+    (void)arg;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Start argv[0] inside dir_name, which must already hold the rootfs. Returns the child's pid and
+// stores a pidfd for wait_container() (-1 on kernels without clone3()), or returns -1.
+pid_t spawn_container(const char *dir_name, char *const argv[], int stdout_fd, int stderr_fd, int *pidfd) {
+    *pidfd = -1;
+    // The launcher sleeps until the child has exec'd, so the child's stack can live in this frame
+    static_assert(CHILD_STACK_SIZE % 16 == 0, "the child stack must keep the ABI alignment");
+    char stack[CHILD_STACK_SIZE] __attribute__((aligned(16)));
+    ExecRequest request = { dir_name, argv, stdout_fd, stderr_fd, NULL, 0 };
+
+    struct clone_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CONTAINER_NAMESPACES | CLONE_VM | CLONE_VFORK | CLONE_PIDFD;
+    args.pidfd = (uint64_t)(uintptr_t)pidfd;
+    args.exit_signal = SIGCHLD;
+    args.stack = (uint64_t)(uintptr_t)stack;
+    args.stack_size = sizeof(stack);
+
+    int cgroup_fd = -1;
+    if (cgroup_dir) {
+        cgroup_fd = open(cgroup_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cgroup_fd == -1) {
+            perror("Error opening cgroup");
+            return -1;
+        }
+        args.flags |= CLONE_INTO_CGROUP;
+        args.cgroup = (uint64_t)cgroup_fd;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    metrics_mark_spawn(SPAWN_CLONE3);
+    long pid = clone3_on_stack(&args, exec_container, &request);
+    if (pid == -1 && errno == ENOSYS && cgroup_fd == -1) {
+        // Before Linux 5.3 (or without the clone3 trampoline): the same through clone(), waited for by pid
+        pid = clone(exec_container, stack + sizeof(stack), CONTAINER_NAMESPACES | CLONE_VM | CLONE_VFORK | SIGCHLD,
+                    &request);
+    }
+
+    int saved_errno = errno;
+    if (cgroup_fd != -1) {
+        close(cgroup_fd);
+    }
+    if (pid != -1 && request.failed_step) {
+        // The child has already exited, reap it and report what it couldn't do
+        errno = request.error;
+        perror(request.failed_step);
+        int status;
+        wait_container((pid_t)pid, *pidfd, &status);
+        *pidfd = -1;
+        saved_errno = request.error;
+        pid = -1;
+    } else if (pid != -1) {
+        metrics_observe_exec(); // --> the vfork is released by the exec, this is its time
+    }
+    errno = saved_errno;
+    return (pid_t)pid;
+}
+
+// Wait for the container through its pidfd when there is one, status is filled in like wait() does
+int wait_container(pid_t pid, int pidfd, int *status) {
+    if (pidfd == -1) {
+        while (waitpid(pid, status, 0) == -1) {
+            if (errno != EINTR) return -1;
+        }
+        return 0;
+    }
+
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    while (waitid((idtype_t)P_PIDFD, pidfd, &info, WEXITED) == -1) {
+        if (errno != EINTR) {
+            close(pidfd);
+            return -1;
+        }
+    }
+    close(pidfd);
+
+    if (info.si_code == CLD_EXITED) {
+        *status = W_EXITCODE(info.si_status, 0);
+    } else {
+        *status = info.si_status | (info.si_code == CLD_DUMPED ? WCOREFLAG : 0);
+    }
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <sys/types.h>
+
+typedef enum SpawnMode {
+    SPAWN_CLONE3,   // rootfs prepared by the launcher, child cloned into its namespaces (default)
+    SPAWN_FORK,     // unshare(CLONE_NEWPID) in the launcher, fork, child fetches the image itself
+    SPAWN_MODES
+} SpawnMode;
+
+int parse_spawn_option(const char *arg);
+SpawnMode spawn_mode();
+pid_t spawn_container(const char *dir_name, char *const argv[], int stdout_fd, int stderr_fd, int *pidfd);
+int wait_container(pid_t pid, int pidfd, int *status);
+#endif
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE // --> for O_DIRECTORY / O_NOFOLLOW with openat()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
+#include "systemUtils.h"
+
+// Create a directory and any missing parents, like mkdir -p
+int mkdir_p(const char *path, mode_t mode) {
+    char buf[1024];
+    if (strlen(path) >= sizeof(buf)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(buf, path);
+
+    for (char *p = buf + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(buf, mode) == -1 && errno != EEXIST) {
+            return -1;
+        }
+        *p = '/';
+    }
+    if (mkdir(buf, mode) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+// Create path (and missing parents) for state written by root and check that it is a real directory
+// owned by us that nobody else can write to, so other users can't plant or redirect files in it
+int ensure_private_dir(const char *path) {
+    if (mkdir_p(path, 0700) == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (lstat(path, &st) == -1) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        fprintf(stderr, "Refusing to use %s: it must be a directory owned by uid %d and writable only by it\n",
+                path, (int)geteuid());
+        errno = EPERM;
+        return -1;
+    }
+    return 0;
+}
+
+// Copy the contents of source_dir into destination_dir, sharing extents where the filesystem can reflink
+int copy_tree(const char *source_dir, const char *destination_dir) {
+    char command[2048];
+    snprintf(command, sizeof(command), "cp -a --reflink=auto '%s/.' '%s'", source_dir, destination_dir);
+
+    int result = system(command);
+    if (result == -1) {
+        perror("Failed to execute command");
+        return -1;
+    }
+    return result == 0 ? 0 : -1;
+}
+
+// Remove name (relative to dir_fd) and everything below it, never following symlinks
+int remove_tree_at(int dir_fd, const char *name) {
+    if (unlinkat(dir_fd, name, 0) == 0 || errno == ENOENT) {
+        return 0;
+    }
+    if (errno != EISDIR && errno != EPERM) {
+        return -1;
+    }
+
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+
+    int result = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (remove_tree_at(fd, entry->d_name) == -1) {
+            result = -1;
+        }
+    }
+    closedir(dir);
+
+    if (unlinkat(dir_fd, name, AT_REMOVEDIR) == -1) {
+        return -1;
+    }
+    return result;
+}
+
+// Drop the calling process to idle I/O class and lowest CPU priority
+int set_background_priority() {
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) == -1) {
+        perror("ioprio_set");
+        return -1;
+    }
+    if (setpriority(PRIO_PROCESS, 0, 19) == -1) {
+        perror("setpriority");
+        return -1;
+    }
+    return 0;
+}
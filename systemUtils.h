@@ -0,0 +1,11 @@
+#ifndef SYSTEMUTILS_H
+#define SYSTEMUTILS_H
+
+#include <sys/types.h>
+
+int mkdir_p(const char *path, mode_t mode);
+int ensure_private_dir(const char *path);
+int copy_tree(const char *source_dir, const char *destination_dir);
+int remove_tree_at(int dir_fd, const char *name);
+int set_background_priority();
+#endif
@@ -0,0 +1,82 @@
+#!/bin/sh
+# File deduplication: pulls two overlapping images (tests/fakeRegistry.py) with --dedup into one store
+# and checks the shared entries and their link counts, checkouts (through build/storeCheckout) and gc.
+#  - identical files share one entry even when their mode, owner and mtime differ
+#  - the image's own hard links share an entry, identical files that aren't links stay apart
+#  - a checkout keeps the image's hard links and nothing else, with every file's own metadata
+#  - gc removes exactly the entries no stored rootfs links to
+set -eu
+
+cd "$(dirname "$0")/.."
+DRIVER=build/storeCheckout
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/ldenv_dedup_test_XXXXXX")
+PIDS=""
+trap 'for pid in $PIDS; do kill $pid 2>/dev/null; done; rm -rf "$WORK"' EXIT
+status=0
+
+python3 tests/fakeRegistry.py "$WORK/port" 2> /dev/null &
+PIDS="$PIDS $!"
+for _ in $(seq 50); do
+    [ -s "$WORK/port" ] && break
+    sleep 0.1
+done
+URL="http://127.0.0.1:$(cat "$WORK/port")"
+
+# Docker Hub (always the last mirror) is backed off for good, so the test never goes to the network
+STORE=$WORK/store
+mkdir -p "$STORE"
+echo "https://registry.hub.docker.com 0.000000 0.0 9 4102444800" > "$STORE/mirror_stats"
+
+app() {
+    LDENV_STORE=$STORE LDENV_METRICS_FILE= LDENV_MIRRORS= ./app "$@" > "$WORK/out" 2>&1 || {
+        cat "$WORK/out"
+        echo "FAIL ./app $*"
+        status=1
+    }
+}
+
+expect() {
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: got '$2', expected '$3'"
+        status=1
+    fi
+}
+
+# entry <content>: the store entry for a file with that content
+entry() {
+    hex=$(printf '%s\n' "$1" | sha256sum | cut -d' ' -f1)
+    echo "$STORE/files/$(echo "$hex" | cut -c1-2)/$hex"
+}
+
+A=$STORE/images/dedup/a/rootfs
+B=$STORE/images/dedup/b/rootfs
+app pull --dedup --mirror="$URL" dedup/a
+app pull --dedup --mirror="$URL" dedup/b
+
+expect "different metadata, one entry" "$(stat -c %i "$A/etc/shared")" "$(stat -c %i "$B/etc/shared")"
+expect "shared entry links" "$(stat -c %h "$(entry "shared by both images")")" "3"
+expect "hard links share one entry with the other image" "$(stat -c %h "$(entry "tool in both images")")" "4"
+expect "identical files that aren't links stay apart" \
+    "$(test "$(stat -c %i "$A/etc/copy1")" != "$(stat -c %i "$A/etc/copy2")" && echo yes)" "yes"
+
+mkdir "$WORK/a" "$WORK/b"
+LDENV_STORE=$STORE "$DRIVER" dedup/a "$WORK/a" > /dev/null || { echo "FAIL checkout of dedup/a"; status=1; }
+LDENV_STORE=$STORE "$DRIVER" dedup/b "$WORK/b" > /dev/null || { echo "FAIL checkout of dedup/b"; status=1; }
+expect "checkout keeps the image's hard links" "$(stat -c '%h' "$WORK/a/bin/tool") $(stat -c %i "$WORK/a/bin/tool-link")" \
+    "2 $(stat -c %i "$WORK/a/bin/tool")"
+expect "checkout doesn't link identical files" "$(stat -c %h "$WORK/a/etc/copy1") $(stat -c %h "$WORK/a/etc/copy2")" "1 1"
+expect "checkout of a keeps its metadata" "$(stat -c '%h %a %u:%g %Y' "$WORK/a/etc/shared")" "1 644 0:0 1000000000"
+expect "checkout of b gets its own metadata back" "$(stat -c '%h %a %u:%g %Y' "$WORK/b/etc/shared")" "1 600 1000:1000 1100000000"
+expect "checked out content" "$(cat "$WORK/b/etc/shared")" "shared by both images"
+
+app gc
+expect "gc keeps used entries" "$(cat "$WORK/out")" "[+] Removed 0 unused files from $STORE/files."
+rm -rf "$STORE/images/dedup/a"
+app gc
+expect "gc removes what only a used" "$(cat "$WORK/out")" "[+] Removed 2 unused files from $STORE/files."
+expect "gc leaves shared entries" "$(stat -c %h "$(entry "shared by both images")")" "2"
+expect "entry only a used is gone" "$(test -e "$(entry "only in a")" || echo gone)" "gone"
+
+exit $status
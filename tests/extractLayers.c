@@ -0,0 +1,24 @@
+// Test driver: extract_layers() on the command line.
+// Usage: extractLayers <tar|uring|threads> <jobs> <dest-dir> <layer.tar>...
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "layerExtract.h"
+
+int main(int argc, char *argv[]) {
+    if (argc < 5) {
+        fprintf(stderr, "Usage: %s <tar|uring|threads> <jobs> <dest-dir> <layer.tar>...\n", argv[0]);
+        return 2;
+    }
+
+    char option[64];
+    snprintf(option, sizeof(option), "--extract=%s", argv[1]);
+    if (parse_extract_option(option) != 1) {
+        return 2;
+    }
+    snprintf(option, sizeof(option), "--extract-jobs=%s", argv[2]);
+    if (parse_extract_option(option) != 1) {
+        return 2;
+    }
+    return extract_layers(argv + 4, argc - 4, argv[3]) == 0 ? 0 : 1;
+}
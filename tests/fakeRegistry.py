@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+# Minimal registry for the mirror and dedup tests. Serves a one-layer image for any repository, and
+# the images in IMAGES under their own names.
+# Usage: fakeRegistry.py <port-file> [--delay=<seconds>] [--status=<code>] [--corrupt]
+#   --delay    wait this long before answering every request
+#   --status   answer every request with this status (429 comes with Retry-After: 120)
+#   --corrupt  serve a layer body that doesn't match its digest
+# The listening port is written to <port-file>, every request is logged to stderr as "<port> <path>".
+import hashlib
+import http.server
+import io
+import json
+import socketserver
+import sys
+import tarfile
+import time
+
+
+# A member is (name, data, mode, mtime, uid) for a regular file or (name, target) for a hard link
+def make_layer(members):
+    out = io.BytesIO()
+    with tarfile.open(fileobj=out, mode="w", format=tarfile.GNU_FORMAT) as tar:
+        for member in members:
+            info = tarfile.TarInfo(member[0])
+            if len(member) == 2:
+                info.type = tarfile.LNKTYPE
+                info.linkname = member[1]
+                tar.addfile(info)
+                continue
+            name, data, info.mode, info.mtime, info.uid = member
+            info.gid = info.uid
+            info.size = len(data)
+            tar.addfile(info, io.BytesIO(data))
+    return out.getvalue()
+
+
+# dedup/a and dedup/b share etc/shared (with different metadata) and bin/tool
+SHARED = b"shared by both images\n"
+TOOL = b"tool in both images\n"
+IMAGES = {
+    None: [make_layer([("etc/fake-registry", b"served by the fake registry\n", 0o644, 1700000000, 0)])],
+    "dedup/a": [make_layer([
+        ("etc/shared", SHARED, 0o644, 1000000000, 0),
+        ("etc/a-only", b"only in a\n", 0o644, 1000000000, 0),
+        ("etc/copy1", b"two copies in a\n", 0o644, 1000000000, 0),
+        ("etc/copy2", b"two copies in a\n", 0o644, 1000000000, 0),
+        ("bin/tool", TOOL, 0o755, 1000000000, 0),
+        ("bin/tool-link", "bin/tool"),
+    ])],
+    "dedup/b": [make_layer([
+        ("etc/shared", SHARED, 0o600, 1100000000, 1000),
+        ("etc/b-only", b"only in b\n", 0o644, 1100000000, 0),
+        ("bin/tool", TOOL, 0o755, 1000000000, 0),
+    ])],
+}
+BLOBS = {"sha256:" + hashlib.sha256(layer).hexdigest(): layer for layers in IMAGES.values() for layer in layers}
+
+
+def manifest(layers):
+    return json.dumps({
+        "schemaVersion": 2,
+        "mediaType": "application/vnd.docker.distribution.manifest.v2+json",
+        "config": {"digest": "sha256:" + "0" * 64},
+        "layers": [{"digest": "sha256:" + hashlib.sha256(layer).hexdigest(), "size": len(layer)} for layer in layers],
+    }).encode()
+
+options = {"delay": 0.0, "status": 200, "corrupt": False}
+for arg in sys.argv[2:]:
+    if arg.startswith("--delay="):
+        options["delay"] = float(arg.split("=", 1)[1])
+    elif arg.startswith("--status="):
+        options["status"] = int(arg.split("=", 1)[1])
+    elif arg == "--corrupt":
+        options["corrupt"] = True
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    def log_message(self, *args):
+        pass
+
+    def answer(self, status, body=b"", headers=()):
+        self.send_response(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self):
+        sys.stderr.write("%d %s\n" % (self.server.server_address[1], self.path))
+        sys.stderr.flush()
+        time.sleep(options["delay"])
+        if options["status"] != 200:
+            headers = [("Retry-After", "120")] if options["status"] == 429 else []
+            return self.answer(options["status"], headers=headers)
+        if "/manifests/" in self.path:
+            repository = self.path[len("/v2/"):self.path.index("/manifests/")]
+            return self.answer(200, manifest(IMAGES.get(repository, IMAGES[None])))
+        layer = BLOBS.get(self.path.rsplit("/blobs/", 1)[-1])
+        if "/blobs/" in self.path and layer:
+            return self.answer(200, layer[:-1] + b"x" if options["corrupt"] else layer)
+        self.answer(404)
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+server = Server(("127.0.0.1", 0), Handler)
+with open(sys.argv[1], "w") as port_file:
+    port_file.write("%d\n" % server.server_address[1])
+server.serve_forever()
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Parallel layer extraction must produce the same tree as extracting the layers one after another
+# with tar, applying each layer's whiteouts first. Runs extract_layers() (through build/extractLayers)
+# with more than one job for every backend and compares the trees: types, modes, owners, sizes,
+# file mtimes, link targets and contents. Directory mtimes are not compared, tar sets them to the
+# extraction time for directories it creates on its own.
+set -eu
+
+cd "$(dirname "$0")/.."
+DRIVER=build/extractLayers
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/ldenv_layer_merge_XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+# Build a layer from a list of members (no implicit recursion, so parent directories only get a
+# header when they are listed)
+pack() {
+    layer=$1; shift
+    tar -C "$WORK/src" --no-recursion --numeric-owner -cf "$WORK/$layer.tar" "$@"
+}
+
+# Layer 0: base image
+mkdir -p "$WORK/src" && cd "$WORK/src"
+mkdir -m 0700 etc && echo a0 > etc/a
+mkdir -m 1777 tmp
+mkdir -p usr/lib && echo x > usr/lib/x && ln -s usr/lib lib
+mkdir d && echo keep > d/keep && echo old > d/old
+mkdir o && echo 1 > o/1 && echo 2 > o/2
+echo f > f
+mkdir real && ln -s real link
+echo gone > gone
+if [ "$(id -u)" = 0 ]; then chown 1000:1000 d/keep; fi
+cd - > /dev/null
+pack layer0 etc etc/a tmp usr usr/lib usr/lib/x lib d d/keep d/old o o/1 o/2 f real link gone
+rm -rf "$WORK/src" && mkdir "$WORK/src"
+
+# Layer 1: files below directories without their own header (etc stays 0700, tmp stays 1777, lib/y
+# lands in usr/lib), whiteouts, an opaque directory with a header of its own and an explicit
+# directory over a symlink
+cd "$WORK/src"
+mkdir etc tmp lib d && echo b > etc/b && echo t > tmp/t && echo y > lib/y
+touch d/.wh.old .wh.gone
+mkdir -m 0750 o && touch o/.wh..wh..opq && echo 3 > o/3
+mkdir -m 0710 link && echo z > link/z
+cd - > /dev/null
+pack layer1 etc/b tmp/t lib/y d/.wh.old .wh.gone o o/.wh..wh..opq o/3 link link/z
+rm -rf "$WORK/src" && mkdir "$WORK/src"
+
+# Layer 2: overwrite files, a new directory below the lib symlink, a directory replacing a file
+cd "$WORK/src"
+mkdir etc lib lib/sub && mkdir -m 0705 f
+echo a2 > etc/a && chmod 0600 etc/a && touch -d 2001-02-03 etc/a
+echo q > lib/sub/q && echo inside > f/inside && touch .wh.f
+cd - > /dev/null
+pack layer2 etc/a lib/sub lib/sub/q .wh.f f f/inside
+rm -rf "$WORK/src"
+
+# Reference: plain tar, one layer after another
+apply_layer() {
+    tar -tf "$1" | while IFS= read -r member; do
+        member=${member#./}
+        base=${member##*/}
+        dir=${member%"$base"}
+        case "$base" in
+            .wh..wh..opq) find "$2/$dir" -mindepth 1 -maxdepth 1 -exec rm -rf {} + ;;
+            .wh.*) rm -rf "$2/$dir${base#.wh.}" ;;
+        esac
+    done
+    tar -xpf "$1" -C "$2" --numeric-owner --exclude='.wh.*'
+}
+mkdir "$WORK/expected"
+for layer in layer0 layer1 layer2; do
+    apply_layer "$WORK/$layer.tar" "$WORK/expected"
+done
+
+describe() {
+    (cd "$1" && find . -mindepth 1 \( -type d -printf '%P %y %m %U:%G\n' \) \
+        -o -printf '%P %y %m %U:%G %s %T@ %l\n' | sort)
+}
+describe "$WORK/expected" > "$WORK/expected.list"
+
+status=0
+for backend in tar uring threads; do
+    rm -rf "$WORK/actual" && mkdir "$WORK/actual"
+    if ! "$DRIVER" "$backend" 3 "$WORK/actual" "$WORK/layer0.tar" "$WORK/layer1.tar" "$WORK/layer2.tar" > "$WORK/driver.log" 2>&1; then
+        cat "$WORK/driver.log"
+        echo "FAIL $backend: extraction failed"
+        status=1
+        continue
+    fi
+    describe "$WORK/actual" > "$WORK/actual.list"
+    if diff -u "$WORK/expected.list" "$WORK/actual.list" && diff -r --no-dereference "$WORK/expected" "$WORK/actual"; then
+        echo "ok   $backend"
+    else
+        echo "FAIL $backend: tree differs from sequential extraction"
+        status=1
+    fi
+done
+exit $status
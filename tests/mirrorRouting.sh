@@ -0,0 +1,94 @@
+#!/bin/sh
+# Registry mirror routing: runs `./app pull` against fake registries (tests/fakeRegistry.py) and
+# checks from the "[+] ... fetched from <url>" lines which mirror served each request.
+#  - unmeasured mirrors are tried first, then the one with the lowest time to first byte
+#  - a mirror answering 429 fails over and is then left alone for its Retry-After
+#  - a layer that doesn't match its digest fails over to the next mirror
+set -eu
+
+cd "$(dirname "$0")/.."
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/ldenv_mirror_test_XXXXXX")
+PIDS=""
+trap 'for pid in $PIDS; do kill $pid 2>/dev/null; done; rm -rf "$WORK"' EXIT
+status=0
+
+# start_registry <name> [options]: sets $URL to the registry, requests are logged to $WORK/<name>.log
+start_registry() {
+    name=$1; shift
+    python3 tests/fakeRegistry.py "$WORK/$name.port" "$@" 2> "$WORK/$name.log" &
+    PIDS="$PIDS $!"
+    for _ in $(seq 50); do
+        [ -s "$WORK/$name.port" ] && break
+        sleep 0.1
+    done
+    URL="http://127.0.0.1:$(cat "$WORK/$name.port")"
+}
+
+# new_store <dir>: an image store whose stats have Docker Hub (always the last mirror) backed off for
+# good, so the test never goes to the network
+new_store() {
+    mkdir -p "$1"
+    echo "https://registry.hub.docker.com 0.000000 0.0 9 4102444800" > "$1/mirror_stats"
+}
+
+# pull <store> <image> <mirror>...
+pull() {
+    store=$1; image=$2; shift 2
+    args=""
+    for mirror in "$@"; do args="$args --mirror=$mirror"; done
+    # shellcheck disable=SC2086
+    LDENV_STORE=$store LDENV_METRICS_FILE= LDENV_MIRRORS= ./app pull $args "$image" > "$WORK/out" 2>&1 || {
+        cat "$WORK/out"
+        echo "FAIL pull of $image failed"
+        status=1
+    }
+}
+
+served() {
+    sed -n "s/^\[+\] $1 fetched from \([^ ]*\) .*/\1/p" "$WORK/out" | tail -n 1
+}
+
+expect() {
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: got '$2', expected '$3'"
+        status=1
+    fi
+}
+
+# Latency: the slow mirror is configured first but loses once both have been measured
+start_registry slow --delay=0.5; SLOW=$URL
+start_registry fast; FAST=$URL
+new_store "$WORK/store1"
+pull "$WORK/store1" test/one "$SLOW" "$FAST"
+expect "unmeasured mirror gets the manifest" "$(served "Image manifest")" "$SLOW"
+expect "unmeasured mirror gets the layer" "$(served Layer)" "$FAST"
+pull "$WORK/store1" test/two "$SLOW" "$FAST"
+expect "fastest mirror gets the next manifest" "$(served "Image manifest")" "$FAST"
+expect "stats are kept in the store" "$(test -f "$WORK/store1/mirror_stats" && echo yes)" "yes"
+
+# Rate limiting: 429 fails over, and the mirror is skipped while its Retry-After runs
+start_registry limited --status=429; LIMITED=$URL
+start_registry good; GOOD=$URL
+new_store "$WORK/store2"
+pull "$WORK/store2" test/one "$LIMITED" "$GOOD"
+expect "429 fails over" "$(grep -c "Failing over to $GOOD" "$WORK/out")" "1"
+expect "manifest after a 429" "$(served "Image manifest")" "$GOOD"
+expect "layer after a 429" "$(served Layer)" "$GOOD"
+pull "$WORK/store2" test/two "$LIMITED" "$GOOD"
+expect "backed off mirror is not asked again" "$(wc -l < "$WORK/limited.log" | tr -d ' ')" "1"
+
+# Digest: a mirror serving a corrupt layer fails over to one serving the right blob. The good mirror
+# starts out measured as slow, so the corrupt one is asked first.
+start_registry corrupt --corrupt; CORRUPT=$URL
+start_registry backup; BACKUP=$URL
+new_store "$WORK/store3"
+echo "$BACKUP 1.000000 0.0 0 0" >> "$WORK/store3/mirror_stats"
+pull "$WORK/store3" test/one "$CORRUPT" "$BACKUP"
+expect "corrupt layer is rejected" "$(grep -c "does not match its digest" "$WORK/out")" "1"
+expect "layer after a digest mismatch" "$(served Layer)" "$BACKUP"
+expect "stored layer is the right one" "$(cat "$WORK/store3/images/test/one/rootfs/etc/fake-registry" 2>/dev/null)" \
+    "served by the fake registry"
+
+exit $status
@@ -0,0 +1,12 @@
+// Test driver: image_store_checkout() on the command line, the store comes from LDENV_STORE.
+// Usage: storeCheckout <image> <dest-dir>
+#include <stdio.h>
+#include "imageStore.h"
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <image> <dest-dir>\n", argv[0]);
+        return 2;
+    }
+    return image_store_checkout(argv[1], argv[2]) == 0 ? 0 : 1;
+}